@@ -1,10 +1,13 @@
 #ifndef _ez_common_h_
 #define _ez_common_h_
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,22 +17,78 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#define VERSION 2.4.0
+
+/*
+** Sockets passed by a service manager (LISTEN_FDS) begin at
+** descriptor EZ_LISTEN_FDS_START.
+*/
 
-#define VERSION 2.3.0
+#define EZ_LISTEN_FDS_START 3
 
+char pidfile[PATH_MAX] = PIDFILE;
 int disable_all_logs = 0;
+int foreground = 0;
+int listen_fds = 0;
 int shutdown_before_close = 0;
 int so_linger = -1;
 int sock_fd = -1;
 int terminated = 0;
+void (*onexit_function)(void) = 0;
+int ez_listen_fds(void);
+int ez_replace_file(const char *path, const void *buffer, size_t length,
+		    int sync);
+int ez_write_pidfile(void);
 void ez_close(const int fd);
+void ez_close_descriptors(int first);
+void ez_notify(const char *state);
 void onexit(void);
 void onterm(int);
 void preconnect_init(void);
 void turn_into_daemon(void);
 
+int ez_listen_fds(void)
+{
+  char *endptr;
+  const char *str = 0;
+  long value = 0;
+
+  /*
+  ** The descriptors are only intended for this process.
+  */
+
+  if((str = getenv("LISTEN_PID")) == 0)
+    return 0;
+
+  errno = 0;
+  value = strtol(str, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == str ||
+     value != (long) getpid())
+    return 0;
+
+  if((str = getenv("LISTEN_FDS")) == 0)
+    return 0;
+
+  value = strtol(str, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == str ||
+     value <= 0 || value > 64)
+    return 0;
+
+  unsetenv("LISTEN_FDNAMES");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_PID");
+  return (int) value;
+}
+
 void ez_close(const int fd)
 {
   if(shutdown_before_close)
@@ -47,19 +106,108 @@ void ez_close(const int fd)
   close(fd);
 }
 
+void ez_close_descriptors(int first)
+{
+  DIR *dir = 0;
+  int fd = 0;
+  rlim_t i = 0;
+  struct dirent *entry = 0;
+  struct rlimit rl;
+
+  /*
+  ** Close every descriptor numbered first or higher.
+  */
+
+#if defined(__linux__) && defined(SYS_close_range)
+  if(syscall(SYS_close_range, (unsigned int) first, ~0U, 0U) == 0)
+    return;
+#endif
+
+#if defined(__linux__)
+  dir = opendir("/proc/self/fd");
+#else
+  dir = opendir("/dev/fd");
+#endif
+
+  if(dir)
+    {
+      while((entry = readdir(dir)) != 0)
+	{
+	  fd = atoi(entry->d_name);
+
+	  if(fd >= first && fd != dirfd(dir))
+	    close(fd);
+	}
+
+      closedir(dir);
+      return;
+    }
+
+  if(getrlimit(RLIMIT_NOFILE, &rl) != 0)
+    return;
+
+  if(rl.rlim_max == RLIM_INFINITY)
+    rl.rlim_max = 2048;
+
+  for(i = (rlim_t) first; i < rl.rlim_max; i++)
+    close((int) i);
+}
+
+void ez_notify(const char *state)
+{
+  const char *path = 0;
+  int fd = -1;
+  size_t length = 0;
+  struct sockaddr_un addr;
+
+  /*
+  ** Readiness notification for service managers (NOTIFY_SOCKET).
+  */
+
+  if(!state || (path = getenv("NOTIFY_SOCKET")) == 0)
+    return;
+
+  length = strlen(path);
+
+  if(length < 2 || length >= sizeof(addr.sun_path) ||
+     (path[0] != '/' && path[0] != '@'))
+    return;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, length);
+
+  if(addr.sun_path[0] == '@')
+    addr.sun_path[0] = 0;
+
+  if((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+    return;
+
+  if(sendto(fd, state, strlen(state), 0, (const struct sockaddr *) &addr,
+	    (socklen_t) (offsetof(struct sockaddr_un, sun_path) + length)) ==
+     -1)
+    if(disable_all_logs == 0)
+      syslog(LOG_ERR, "unable to notify %s, %s", path, strerror(errno));
+
+  close(fd);
+}
+
 void onexit(void)
 {
   int err = 0;
 
-  if(remove(PIDFILE) != 0)
+  if(onexit_function)
+    onexit_function();
+
+  if(strlen(pidfile) > 0 && remove(pidfile) != 0)
     {
       err = errno;
 
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "unable to remove() %s, %s", PIDFILE,
+	syslog(LOG_ERR, "unable to remove() %s, %s", pidfile,
 	       strerror(err));
 
-      fprintf(stderr, "Unable to remove() %s, %s.\n", PIDFILE,
+      fprintf(stderr, "Unable to remove() %s, %s.\n", pidfile,
 	      strerror(err));
     }
 
@@ -97,70 +245,88 @@ void onterm(int notused)
   exit(EXIT_SUCCESS);
 }
 
-void preconnect_init(void)
+int ez_replace_file(const char *path, const void *buffer, size_t length,
+		    int sync)
 {
-  char pidbuf[64];
+  char tmp[PATH_MAX];
   int err = 0;
   int fd = -1;
   int n = 0;
-  size_t pidbuf_length = 0;
-  ssize_t rc = 0;
-  struct sigaction act;
 
-  if(atexit(onexit) != 0)
-    {
-      err = errno;
+  /*
+  ** Write a unique temporary file next to path and rename it over path.
+  ** The temporary file is removed if any step fails.
+  */
+
+  n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
 
+  if(!(n > 0 && n < (int) sizeof(tmp)))
+    {
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "atexit() failed, %s", strerror(err));
+	syslog(LOG_ERR, "the path %s is too long", path);
 
-      fprintf(stderr, "atexit() failed, %s.\n", strerror(err));
-      exit(EXIT_FAILURE);
+      return -1;
     }
 
-  /*
-  ** Ignore SIGHUP and SIGPIPE.
-  */
+  if((fd = mkstemp(tmp)) == -1)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "mkstemp() failed for %s, %s", tmp, strerror(errno));
 
-  act.sa_handler = SIG_IGN;
-  sigemptyset(&act.sa_mask);
-  act.sa_flags = 0;
-  sigaction(SIGHUP, &act, 0);
-  act.sa_handler = SIG_IGN;
-  sigemptyset(&act.sa_mask);
-  act.sa_flags = 0;
-  sigaction(SIGPIPE, &act, 0);
+      return -1;
+    }
 
-  /*
-  ** Configure a handler for the SIGTERM signal.
-  */
+  if(fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+     write(fd, buffer, length) != (ssize_t) length ||
+     (sync && fsync(fd) != 0))
+    {
+      err = errno;
 
-  act.sa_handler = onterm;
-  sigemptyset(&act.sa_mask);
-  act.sa_flags = 0;
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "write() failed for %s, %s", tmp, strerror(err));
 
-  if(sigaction(SIGTERM, &act, 0) != 0)
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+
+  if(close(fd) != 0 || rename(tmp, path) != 0)
     {
       err = errno;
 
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "sigaction() failed, %s", strerror(err));
+	syslog(LOG_ERR, "rename() failed for %s, %s", path, strerror(err));
 
-      fprintf(stderr, "sigaction() failed, %s.\n", strerror(err));
-      exit(EXIT_FAILURE);
+      unlink(tmp);
+      return -1;
     }
 
-  if((fd = open(PIDFILE, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR)) == -1)
+  return 0;
+}
+
+int ez_write_pidfile(void)
+{
+  char pidbuf[64];
+  int err = 0;
+  int fd = -1;
+  int n = 0;
+  size_t pidbuf_length = 0;
+  ssize_t rc = 0;
+
+  if(strlen(pidfile) == 0)
+    return 0;
+
+  if((fd = open(pidfile, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR)) == -1)
     {
       err = errno;
 
       if(disable_all_logs == 0)
 	syslog(LOG_ERR, "open() failed for %s, %s, exiting",
-	       PIDFILE, strerror(err));
+	       pidfile, strerror(err));
 
       fprintf(stderr, "open() failed for %s, %s, exiting.\n",
-	      PIDFILE, strerror(err));
-      exit(EXIT_FAILURE);
+	      pidfile, strerror(err));
+      return -1;
     }
   else
     {
@@ -174,7 +340,7 @@ void preconnect_init(void)
 
 	  fprintf(stderr, "%s failed, exiting.\n", "snprintf()");
 	  close(fd);
-	  exit(EXIT_FAILURE);
+	  return -1;
 	}
 
       pidbuf_length = strlen(pidbuf);
@@ -185,22 +351,22 @@ void preconnect_init(void)
 
 	  if(disable_all_logs == 0)
 	    syslog(LOG_ERR, "write() failed for %s, %s, exiting",
-		   PIDFILE, strerror(err));
+		   pidfile, strerror(err));
 
 	  fprintf(stderr, "write() failed for %s, %s, exiting.\n",
-		  PIDFILE, strerror(err));
+		  pidfile, strerror(err));
 	  close(fd);
-	  exit(EXIT_FAILURE);
+	  return -1;
 	}
       else if((ssize_t) pidbuf_length != rc)
 	{
 	  if(disable_all_logs == 0)
 	    syslog(LOG_ERR, "write() error for %s, %s, exiting",
-		   PIDFILE, strerror(err));
+		   pidfile, strerror(err));
 
 	  fprintf(stderr, "write() error for %s, %s, exiting.\n",
-		  PIDFILE, strerror(err));
-	  exit(EXIT_FAILURE);
+		  pidfile, strerror(err));
+	  return -1;
 	}
     }
 
@@ -209,41 +375,85 @@ void preconnect_init(void)
       err = errno;
 
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "close() failed for %d (%s), %s", fd, PIDFILE,
+	syslog(LOG_ERR, "close() failed for %d (%s), %s", fd, pidfile,
 	       strerror(err));
 
-      fprintf(stderr, "close() failed for %d (%s), %s.\n", fd, PIDFILE,
+      fprintf(stderr, "close() failed for %d (%s), %s.\n", fd, pidfile,
 	      strerror(err));
     }
+
+  return 0;
 }
 
-void turn_into_daemon(void)
+void preconnect_init(void)
 {
   int err = 0;
-  int fd0 = 0;
-  int fd1 = 0;
-  int fd2 = 0;
-  pid_t pid = 0;
-  rlim_t i = 0;
-  struct rlimit rl;
+  struct sigaction act;
+
+  if(atexit(onexit) != 0)
+    {
+      err = errno;
+
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "atexit() failed, %s", strerror(err));
+
+      fprintf(stderr, "atexit() failed, %s.\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
 
   /*
-  ** Turn into a daemon.
+  ** Ignore SIGHUP and SIGPIPE.
   */
 
-  if(getrlimit(RLIMIT_NOFILE, &rl) != 0)
+  act.sa_handler = SIG_IGN;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;
+  sigaction(SIGHUP, &act, 0);
+  act.sa_handler = SIG_IGN;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;
+  sigaction(SIGPIPE, &act, 0);
+
+  /*
+  ** Configure a handler for the SIGTERM signal.
+  */
+
+  act.sa_handler = onterm;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;
+
+  if(sigaction(SIGTERM, &act, 0) != 0)
     {
       err = errno;
 
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "getrlimit() failed, %s, exiting", strerror(err));
+	syslog(LOG_ERR, "sigaction() failed, %s", strerror(err));
 
-      fprintf(stderr, "getrlimit() failed, %s, exiting.\n", strerror(err));
+      fprintf(stderr, "sigaction() failed, %s.\n", strerror(err));
       exit(EXIT_FAILURE);
     }
 
+  if(ez_write_pidfile() != 0)
+    exit(EXIT_FAILURE);
+}
+
+void turn_into_daemon(void)
+{
+  int err = 0;
+  int fd0 = 0;
+  int fd1 = 0;
+  int fd2 = 0;
+  pid_t pid = 0;
+
+  /*
+  ** Turn into a daemon.
+  */
+
   umask(0);
 
+  if(foreground)
+    return;
+
   if((pid = fork()) < 0)
     {
       if(disable_all_logs == 0)
@@ -268,12 +478,14 @@ void turn_into_daemon(void)
       exit(EXIT_FAILURE);
     }
 
-  if(rl.rlim_max == RLIM_INFINITY)
-    rl.rlim_max = 2048;
+  /*
+  ** Preserve the inherited listening sockets.
+  */
 
-  for(i = 0; i < rl.rlim_max; i++)
-    close((int) i);
+  for(fd0 = 0; fd0 < EZ_LISTEN_FDS_START; fd0++)
+    close(fd0);
 
+  ez_close_descriptors(EZ_LISTEN_FDS_START + listen_fds);
   fd0 = open("/dev/null", O_RDWR);
   fd1 = dup(0);
   fd2 = dup(1);
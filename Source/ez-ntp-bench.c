@@ -0,0 +1,633 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+** ez-ntp-bench, encode and decode costs of the response format and the
+** cost and accuracy of stamps.
+**
+** The legacy functions reproduce the encoder and parser which preceded
+** ez_ntp_format() and ez_ntp_parse(). Before timing, both encoders are
+** checked for identical output and both parsers for identical results.
+**
+** TSC stamps are compared with gettimeofday() calls on either side for
+** EZ_BENCH_ACCURACY seconds, spanning several recalibrations, and are then
+** read back to back for as long to check that they never decrease.
+**
+** With --jitter, running servers are queried instead. Each server's stamp
+** is compared with the moment connect() completed, which shows how long
+** the server takes to read the time after a connection arrives. Run it
+** against a daemon on the same host, with and without its low-latency
+** option.
+*/
+
+/*
+** -- System Includes --
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*
+** -- Local Includes --
+*/
+
+#include "ez-ntp.h"
+
+#define EZ_BENCH_ACCURACY 3 /* Seconds. */
+#define EZ_BENCH_ITERATIONS 2000000L
+#define EZ_BENCH_QUERIES 5000L
+#define EZ_BENCH_SAMPLES 1024
+#define EZ_BENCH_TIMEOUT 1000 /* Milliseconds. */
+
+static char buffers[EZ_BENCH_SAMPLES][2 * sizeof(long unsigned int) + 64];
+static int legacy_format(char *, size_t, const struct ez_ntp_response *,
+			 int);
+static int legacy_parse(const char *, size_t, struct ez_ntp_response *);
+static int lengths[EZ_BENCH_SAMPLES];
+static struct ez_ntp_response responses[EZ_BENCH_SAMPLES];
+static volatile long sink = 0;
+static double elapsed(const struct timespec *, const struct timespec *);
+static int bench_jitter(const char *, long);
+static int compare_long(const void *, const void *);
+static long percentile(const long *, size_t, size_t);
+static void bench_decode(const char *,
+			 int (*)(const char *, size_t,
+				 struct ez_ntp_response *));
+static void bench_encode(const char *,
+			 int (*)(char *, size_t,
+				 const struct ez_ntp_response *, int),
+			 int);
+static void bench_stamp(const char *, int (*)(struct timeval *));
+static void bench_stamp_accuracy(void);
+static void bench_stamp_monotonic(void);
+static int stamp_gettimeofday(struct timeval *);
+
+int main(int argc, char *argv[])
+{
+  char *endptr;
+  char expected[2 * sizeof(long unsigned int) + 64];
+  char produced[2 * sizeof(long unsigned int) + 64];
+  int fields = 0;
+  int i = 0;
+  int n = 0;
+  int status = EXIT_SUCCESS;
+  long queries = EZ_BENCH_QUERIES;
+  struct ez_ntp_response legacy;
+  struct ez_ntp_response response;
+  struct timeval tp;
+
+  /*
+  ** ez-ntp-bench --jitter [--queries N] IP-ADDRESS:PORT...
+  */
+
+  if(argc > 1 && strcmp(argv[1], "--jitter") == 0)
+    {
+      for(i = 2; i < argc; i++)
+	if(strcmp(argv[i], "--queries") == 0)
+	  {
+	    errno = 0;
+	    queries = i + 1 < argc ? strtol(argv[++i], &endptr, 10) : 0;
+
+	    if(queries <= 0 || errno == ERANGE || *endptr != 0 ||
+	       queries > 10000000L)
+	      {
+		fprintf(stderr, "%s", "Invalid number of queries, exiting.\n");
+		return EXIT_FAILURE;
+	      }
+	  }
+
+      printf("%s", "Server stamp minus connect() completion, usec:\n");
+
+      for(i = 2; i < argc; i++)
+	if(strcmp(argv[i], "--queries") == 0)
+	  i++;
+	else if(bench_jitter(argv[i], queries) != 0)
+	  status = EXIT_FAILURE;
+
+      return status;
+    }
+  else if(argc > 1)
+    {
+      fprintf(stderr, "Invalid option %s, exiting.\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+
+  gettimeofday(&tp, 0);
+  srand((unsigned int) tp.tv_usec);
+
+  /*
+  ** Plausible responses, plus the extremes of each field.
+  */
+
+  for(i = 0; i < EZ_BENCH_SAMPLES; i++)
+    {
+      memset(&responses[i], 0, sizeof(responses[i]));
+      responses[i].server_tp.tv_sec = tp.tv_sec + rand() % 100000;
+      responses[i].server_tp.tv_usec = rand() % 1000000;
+      responses[i].stratum = rand() % (EZ_NTP_MAX_STRATUM + 1);
+      responses[i].error = rand() % (i % 2 == 0 ? 100 : 16000000);
+      responses[i].previous_tp.tv_sec = i % 3 == 0 ? 0 : tp.tv_sec;
+      responses[i].previous_tp.tv_usec = i % 3 == 0 ? 0 : rand() % 1000000;
+      responses[i].previous_transmit_tp = responses[i].previous_tp;
+    }
+
+  responses[0].server_tp.tv_sec = 0;
+  responses[0].server_tp.tv_usec = 0;
+  responses[1].server_tp.tv_usec = 999999;
+  responses[2].server_tp.tv_sec = -1;
+  responses[3].error = 2147483647L;
+
+  for(fields = 2; fields <= 8; fields *= 2)
+    for(i = 0; i < EZ_BENCH_SAMPLES; i++)
+      {
+	n = legacy_format(expected, sizeof(expected), &responses[i], fields);
+
+	if(ez_ntp_format(produced, sizeof(produced), &responses[i],
+			 fields) != n || memcmp(expected, produced,
+						(size_t) n + 1) != 0)
+	  {
+	    fprintf(stderr, "Encoders differ for %s.\n", expected);
+	    return EXIT_FAILURE;
+	  }
+
+	if(legacy_parse(expected, (size_t) n, &legacy) != EZ_NTP_DONE ||
+	   ez_ntp_parse(expected, (size_t) n, &response) != EZ_NTP_DONE ||
+	   memcmp(&legacy, &response, sizeof(legacy)) != 0)
+	  {
+	    fprintf(stderr, "Parsers differ for %s.\n", expected);
+	    return EXIT_FAILURE;
+	  }
+      }
+
+  for(fields = 2; fields <= 8; fields *= 2)
+    {
+      printf("%d fields:\n", fields);
+      bench_encode("  encode snprintf()", legacy_format, fields);
+      bench_encode("  encode ez_ntp_format()", ez_ntp_format, fields);
+
+      for(i = 0; i < EZ_BENCH_SAMPLES; i++)
+	lengths[i] = ez_ntp_format(buffers[i], sizeof(buffers[i]),
+				   &responses[i], fields);
+
+      bench_decode("  decode strtol()", legacy_parse);
+      bench_decode("  decode ez_ntp_parse()", ez_ntp_parse);
+    }
+
+  printf("%s", "Stamps:\n");
+  bench_stamp("  gettimeofday()", stamp_gettimeofday);
+
+  if(ez_ntp_tsc_start() != 0)
+    {
+      printf("  TSC unavailable, %s.\n", strerror(errno));
+      return EXIT_SUCCESS;
+    }
+
+  bench_stamp("  ez_ntp_gettime() TSC", ez_ntp_gettime);
+  bench_stamp_accuracy();
+  bench_stamp_monotonic();
+  return EXIT_SUCCESS;
+}
+
+static int bench_jitter(const char *address, long queries)
+{
+  int connected = 0;
+  int rc = 0;
+  long failures = 0;
+  long i = 0;
+  long *samples = 0;
+  size_t count = 0;
+  struct ez_ntp_query query;
+  struct pollfd pfd;
+  struct sockaddr_in addr;
+  struct timeval connected_tp;
+  struct timeval tp;
+
+  if(ez_ntp_parse_address(address, &addr) != EZ_NTP_DONE)
+    {
+      fprintf(stderr, "Invalid server %s, exiting.\n", address);
+      return -1;
+    }
+
+  if((samples = malloc((size_t) queries * sizeof(*samples))) == 0)
+    {
+      fprintf(stderr, "%s", "malloc() failed, exiting.\n");
+      return -1;
+    }
+
+  ez_ntp_query_init(&query);
+
+  /*
+  ** Sequential queries. The connection is stamped as soon as the query
+  ** leaves the connecting state.
+  */
+
+  for(i = 0; i < queries; i++)
+    {
+      connected = 0;
+      rc = ez_ntp_query_start(&query, &addr);
+
+      while(rc == EZ_NTP_AGAIN)
+	{
+	  if(!connected && query.state == EZ_NTP_STATE_READING)
+	    {
+	      gettimeofday(&connected_tp, 0);
+	      connected = 1;
+	    }
+
+	  pfd.events = ez_ntp_query_events(&query);
+	  pfd.fd = ez_ntp_query_fd(&query);
+	  pfd.revents = 0;
+
+	  if((rc = poll(&pfd, 1, EZ_BENCH_TIMEOUT)) == -1 && errno == EINTR)
+	    rc = EZ_NTP_AGAIN;
+	  else if(rc <= 0)
+	    {
+	      ez_ntp_query_cancel(&query);
+	      rc = EZ_NTP_ERROR;
+	    }
+	  else
+	    rc = ez_ntp_query_process(&query, pfd.revents);
+	}
+
+      if(rc != EZ_NTP_DONE || !connected)
+	{
+	  failures += 1;
+	  continue;
+	}
+
+      timersub(&query.sample.response.server_tp, &connected_tp, &tp);
+      samples[count++] = ez_ntp_timeval_to_usec(&tp);
+    }
+
+  if(count == 0)
+    {
+      printf("  %-22s no responses, %ld failures\n", address, failures);
+      free(samples);
+      return -1;
+    }
+
+  qsort(samples, count, sizeof(*samples), compare_long);
+  printf("  %-22s p50 %ld, p90 %ld, p99 %ld, p99.9 %ld, max %ld; "
+	 "%lu queries, %ld failures\n", address,
+	 percentile(samples, count, 500), percentile(samples, count, 900),
+	 percentile(samples, count, 990), percentile(samples, count, 999),
+	 samples[count - 1], (unsigned long) count, failures);
+  free(samples);
+  return 0;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+  long x = *((const long *) a);
+  long y = *((const long *) b);
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static long percentile(const long *sorted, size_t count, size_t permille)
+{
+  return sorted[(count - 1) * permille / 1000];
+}
+
+static int stamp_gettimeofday(struct timeval *tp)
+{
+  return gettimeofday(tp, 0);
+}
+
+static double elapsed(const struct timespec *start,
+		      const struct timespec *end)
+{
+  return (double) (end->tv_sec - start->tv_sec) * 1000000000.0 +
+    (double) (end->tv_nsec - start->tv_nsec);
+}
+
+static int legacy_format(char *buffer, size_t size,
+			 const struct ez_ntp_response *response, int fields)
+{
+  int n = 0;
+
+  memset(buffer, 0, size);
+
+  if(fields == 8)
+    n = snprintf(buffer, size, "%ld,%ld,%d,%ld,%ld,%ld,%ld,%ld\r\n",
+		 (long) response->server_tp.tv_sec,
+		 (long) response->server_tp.tv_usec, response->stratum,
+		 response->error, (long) response->previous_tp.tv_sec,
+		 (long) response->previous_tp.tv_usec,
+		 (long) response->previous_transmit_tp.tv_sec,
+		 (long) response->previous_transmit_tp.tv_usec);
+  else if(fields == 4)
+    n = snprintf(buffer, size, "%ld,%ld,%d,%ld\r\n",
+		 (long) response->server_tp.tv_sec,
+		 (long) response->server_tp.tv_usec, response->stratum,
+		 response->error);
+  else
+    n = snprintf(buffer, size, "%ld,%ld\r\n",
+		 (long) response->server_tp.tv_sec,
+		 (long) response->server_tp.tv_usec);
+
+  if(!(n > 0 && n < (int) size))
+    return -1;
+
+  return (int) strlen(buffer);
+}
+
+static int legacy_parse(const char *buffer, size_t length,
+			struct ez_ntp_response *response)
+{
+  char line[2 * sizeof(long unsigned int) + 64];
+  char *endptr;
+  char *ptr = 0;
+  long value = 0;
+  size_t i = 0;
+
+  if(!buffer || !response)
+    return EZ_NTP_ERROR;
+
+  for(i = 0; i + 1 < length; i++)
+    if(buffer[i] == '\r' && buffer[i + 1] == '\n')
+      break;
+
+  if(i + 1 >= length || i < 3 || i >= sizeof(line))
+    return EZ_NTP_ERROR;
+
+  memset(line, 0, sizeof(line));
+  memcpy(line, buffer, i);
+  memset(response, 0, sizeof(*response));
+
+  /*
+  ** Seconds.
+  */
+
+  errno = 0;
+  ptr = line;
+  value = strtol(ptr, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == ptr || *endptr != ',')
+    return EZ_NTP_ERROR;
+
+  response->server_tp.tv_sec = (time_t) value;
+
+  /*
+  ** Microseconds.
+  */
+
+  ptr = endptr + 1;
+  value = strtol(ptr, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == ptr ||
+     value < 0 || value >= 1000000L || (*endptr != ',' && *endptr != 0))
+    return EZ_NTP_ERROR;
+
+  response->server_tp.tv_usec = (suseconds_t) value;
+
+  if(*endptr == 0)
+    return EZ_NTP_DONE;
+
+  /*
+  ** Stratum and error.
+  */
+
+  ptr = endptr + 1;
+  value = strtol(ptr, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == ptr ||
+     value < 0 || value > EZ_NTP_MAX_STRATUM || *endptr != ',')
+    return EZ_NTP_ERROR;
+
+  response->stratum = (int) value;
+  ptr = endptr + 1;
+  value = strtol(ptr, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == ptr ||
+     value < 0 || (*endptr != ',' && *endptr != 0))
+    return EZ_NTP_ERROR;
+
+  response->error = value;
+
+  if(*endptr == 0)
+    return EZ_NTP_DONE;
+
+  /*
+  ** The previous stamp and its transmit time.
+  */
+
+  for(i = 0; i < 4; i++)
+    {
+      ptr = endptr + 1;
+      value = strtol(ptr, &endptr, 10);
+
+      if(errno == EINVAL || errno == ERANGE || endptr == ptr || value < 0 ||
+	 (i % 2 == 1 && value >= 1000000L) ||
+	 *endptr != (i < 3 ? ',' : 0))
+	return EZ_NTP_ERROR;
+
+      if(i == 0)
+	response->previous_tp.tv_sec = (time_t) value;
+      else if(i == 1)
+	response->previous_tp.tv_usec = (suseconds_t) value;
+      else if(i == 2)
+	response->previous_transmit_tp.tv_sec = (time_t) value;
+      else
+	response->previous_transmit_tp.tv_usec = (suseconds_t) value;
+    }
+
+  response->interleaved = 1;
+  return EZ_NTP_DONE;
+}
+
+static void bench_decode(const char *name,
+			 int (*parse)(const char *, size_t,
+				      struct ez_ntp_response *))
+{
+  long i = 0;
+  long total = 0;
+  struct ez_ntp_response response;
+  struct timespec end;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(i = 0; i < EZ_BENCH_ITERATIONS; i++)
+    {
+      parse(buffers[i % EZ_BENCH_SAMPLES],
+	    (size_t) lengths[i % EZ_BENCH_SAMPLES], &response);
+      total += (long) response.server_tp.tv_usec;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sink = total;
+  printf("%-28s %8.1f ns per message\n", name,
+	 elapsed(&start, &end) / (double) EZ_BENCH_ITERATIONS);
+}
+
+static void bench_encode(const char *name,
+			 int (*format)(char *, size_t,
+				       const struct ez_ntp_response *, int),
+			 int fields)
+{
+  char buffer[2 * sizeof(long unsigned int) + 64];
+  long i = 0;
+  long total = 0;
+  struct timespec end;
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(i = 0; i < EZ_BENCH_ITERATIONS; i++)
+    total += format(buffer, sizeof(buffer),
+		    &responses[i % EZ_BENCH_SAMPLES], fields);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sink = total;
+  printf("%-28s %8.1f ns per message\n", name,
+	 elapsed(&start, &end) / (double) EZ_BENCH_ITERATIONS);
+}
+
+static void bench_stamp(const char *name, int (*stamp)(struct timeval *))
+{
+  long i = 0;
+  long total = 0;
+  struct timespec end;
+  struct timespec start;
+  struct timeval tp;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(i = 0; i < EZ_BENCH_ITERATIONS; i++)
+    {
+      stamp(&tp);
+      total += (long) tp.tv_usec;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sink = total;
+  printf("%-28s %8.1f ns per stamp\n", name,
+	 elapsed(&start, &end) / (double) EZ_BENCH_ITERATIONS);
+}
+
+static void bench_stamp_accuracy(void)
+{
+  double sum = 0.0;
+  long count = 0;
+  long difference = 0;
+  long maximum = 0;
+  long width = 0;
+  struct timespec ts;
+  struct timeval after_tp;
+  struct timeval before_tp;
+  struct timeval end_tp;
+  struct timeval tp;
+
+  /*
+  ** The TSC stamp is measured against the midpoint of the surrounding
+  ** gettimeofday() calls. Wide brackets (preemption) are skipped.
+  */
+
+  gettimeofday(&end_tp, 0);
+  end_tp.tv_sec += EZ_BENCH_ACCURACY;
+  ts.tv_sec = 0;
+  ts.tv_nsec = 100000;
+
+  do
+    {
+      gettimeofday(&before_tp, 0);
+      ez_ntp_gettime(&tp);
+      gettimeofday(&after_tp, 0);
+      width = ez_ntp_timeval_to_usec(&after_tp) -
+	ez_ntp_timeval_to_usec(&before_tp);
+
+      if(width >= 0 && width <= 2)
+	{
+	  difference = 2 * ez_ntp_timeval_to_usec(&tp) -
+	    ez_ntp_timeval_to_usec(&before_tp) -
+	    ez_ntp_timeval_to_usec(&after_tp);
+	  difference = (difference < 0 ? -difference : difference) / 2;
+	  count += 1;
+	  sum += (double) difference;
+
+	  if(difference > maximum)
+	    maximum = difference;
+	}
+
+      nanosleep(&ts, 0);
+    }
+  while(timercmp(&after_tp, &end_tp, <));
+
+  if(count > 0)
+    printf("  TSC versus gettimeofday()   %8.2f usec mean, %ld usec maximum, "
+	   "%ld stamps over %d s\n", sum / (double) count, maximum, count,
+	   EZ_BENCH_ACCURACY);
+  else
+    printf("%s", "  TSC versus gettimeofday()   no usable brackets\n");
+
+  if(!ez_ntp_tsc_active())
+    printf("%s", "  The TSC was abandoned during the measurement.\n");
+}
+
+static void bench_stamp_monotonic(void)
+{
+  long count = 0;
+  long difference = 0;
+  long maximum = 0;
+  long regressions = 0;
+  struct timeval end_tp;
+  struct timeval previous_tp;
+  struct timeval tp;
+
+  gettimeofday(&end_tp, 0);
+  end_tp.tv_sec += EZ_BENCH_ACCURACY;
+  ez_ntp_gettime(&previous_tp);
+
+  do
+    {
+      ez_ntp_gettime(&tp);
+      count += 1;
+
+      if(timercmp(&tp, &previous_tp, <))
+	{
+	  difference = ez_ntp_timeval_to_usec(&previous_tp) -
+	    ez_ntp_timeval_to_usec(&tp);
+	  regressions += 1;
+
+	  if(difference > maximum)
+	    maximum = difference;
+	}
+
+      previous_tp = tp;
+    }
+  while(timercmp(&tp, &end_tp, <));
+
+  printf("  TSC monotonicity            %ld regressions, %ld usec maximum, "
+	 "%ld stamps over %d s\n", regressions, maximum, count,
+	 EZ_BENCH_ACCURACY);
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Interleaved responses whose previous exchange is never known to the
+# server. The client must still adjust the clock. Run as root from the
+# Source directory after make.
+
+port=50123
+metrics=/tmp/ez-ntp-interleaved-test.prom
+
+rm -f $metrics
+python3 - $port <<'EOF' &
+import socket, sys, time
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(("127.0.0.1", int(sys.argv[1])))
+s.listen(16)
+while True:
+    c, _ = s.accept()
+    t = time.time()
+    c.sendall(b"%d,%d,1,100,0,0,0,0\r\n" % (int(t), int(t * 1e6) % 1000000))
+    c.close()
+EOF
+server=$!
+sleep 1
+
+./ez-ntpc --foreground --pidfile "" --disable-all-logs --host 127.0.0.1 \
+    --port $port --metrics-file $metrics &
+client=$!
+sleep 5
+kill $client $server
+wait 2>/dev/null
+
+adjustments=`grep '^ez_ntpc_adjustments_total{method="\(step\|slew\|none\)"}' \
+    $metrics | awk '{ sum += $2 } END { print sum + 0 }'`
+rm -f $metrics
+
+if [ "$adjustments" -gt 0 ]
+then
+    echo "Passed, $adjustments adjustments."
+    exit 0
+else
+    echo "Failed, the clock was not adjusted."
+    exit 1
+fi
@@ -0,0 +1,536 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+** ez-ntp-scan, a read-only audit of many servers.
+**
+** Targets, one IP-ADDRESS:PORT per line, are queried concurrently from a
+** single event loop with at most concurrency queries outstanding. Each
+** target has timeout milliseconds to answer. The results are written in
+** the order of the targets, as CSV or JSON. The local clock is not
+** modified.
+*/
+
+/*
+** -- System Includes --
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*
+** -- Local Includes --
+*/
+
+#include "ez-ntp.h"
+
+#define EZ_SCAN_DONE 1
+#define EZ_SCAN_FAILED 2
+#define EZ_SCAN_INVALID 3
+#define EZ_SCAN_MAX_CONCURRENCY 65536
+#define EZ_SCAN_MAX_TIMEOUT 60000 /* Milliseconds. */
+#define EZ_SCAN_PENDING 0
+
+struct scan_slot
+{
+  size_t target;
+  struct ez_ntp_query query;
+  struct timespec deadline_tp;
+};
+
+struct scan_target
+{
+  char address[64];
+  int error;
+  int state;
+  int status;
+  struct ez_ntp_sample sample;
+  struct sockaddr_in addr;
+};
+
+static int fast_open = 0;
+static int json = 0;
+static long concurrency = 512;
+static long timeout = 2000; /* Milliseconds. */
+static size_t targets_count = 0;
+static struct scan_target *targets = 0;
+static int scan(void);
+static int targets_read(FILE *);
+static long remaining_ms(const struct timespec *, const struct timespec *);
+static void concurrency_limit(void);
+static void print_quoted(const char *);
+static void print_results(void);
+static void scan_status(const struct scan_target *, char *, size_t);
+
+int main(int argc, char *argv[])
+{
+  FILE *file = stdin;
+  char *endptr;
+  const char *path = 0;
+  int i = 0;
+  size_t answered = 0;
+  size_t j = 0;
+  struct timespec end_tp;
+  struct timespec start_tp;
+
+  for(i = 1; i < argc; i++)
+    if(strcmp(argv[i], "--concurrency") == 0 && i + 1 < argc)
+      {
+	errno = 0;
+	concurrency = strtol(argv[++i], &endptr, 10);
+
+	if(errno == EINVAL || errno == ERANGE || endptr == argv[i] ||
+	   *endptr != 0 || concurrency < 1 ||
+	   concurrency > EZ_SCAN_MAX_CONCURRENCY)
+	  {
+	    fprintf(stderr, "%s", "Invalid concurrency, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(argv[i], "--fast-open") == 0)
+      fast_open = 1;
+    else if(strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+      {
+	i++;
+
+	if(strcmp(argv[i], "csv") == 0)
+	  json = 0;
+	else if(strcmp(argv[i], "json") == 0)
+	  json = 1;
+	else
+	  {
+	    fprintf(stderr, "%s", "Invalid format, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(argv[i], "--targets") == 0 && i + 1 < argc)
+      path = argv[++i];
+    else if(strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+      {
+	errno = 0;
+	timeout = strtol(argv[++i], &endptr, 10);
+
+	if(errno == EINVAL || errno == ERANGE || endptr == argv[i] ||
+	   *endptr != 0 || timeout < 1 || timeout > EZ_SCAN_MAX_TIMEOUT)
+	  {
+	    fprintf(stderr, "%s", "Invalid timeout, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else
+      {
+	fprintf(stderr, "Invalid option %s, exiting.\n", argv[i]);
+	return EXIT_FAILURE;
+      }
+
+  if(path && strcmp(path, "-") != 0 && (file = fopen(path, "r")) == 0)
+    {
+      fprintf(stderr, "fopen() failed for %s, %s, exiting.\n", path,
+	      strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+  if(targets_read(file) != 0)
+    {
+      fprintf(stderr, "%s", "Unable to read the targets, exiting.\n");
+      return EXIT_FAILURE;
+    }
+
+  if(file != stdin)
+    fclose(file);
+
+  concurrency_limit();
+  clock_gettime(CLOCK_MONOTONIC, &start_tp);
+
+  if(scan() != 0)
+    {
+      fprintf(stderr, "poll() failed, %s, exiting.\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &end_tp);
+  print_results();
+
+  for(j = 0; j < targets_count; j++)
+    if(targets[j].status == EZ_SCAN_DONE &&
+       targets[j].sample.response.stratum < EZ_NTP_MAX_STRATUM)
+      answered += 1;
+
+  fprintf(stderr, "%lu of %lu targets synchronized, %ld ms.\n",
+	  (unsigned long) answered, (unsigned long) targets_count,
+	  remaining_ms(&end_tp, &start_tp));
+  free(targets);
+  return answered == targets_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int scan(void)
+{
+  int rc = 0;
+  long wait = 0;
+  size_t active = 0;
+  size_t free_count = 0;
+  size_t i = 0;
+  size_t n = 0;
+  size_t next = 0;
+  size_t *free_slots = 0;
+  size_t *polled = 0;
+  struct pollfd *pfds = 0;
+  struct scan_slot *slot = 0;
+  struct scan_slot *slots = 0;
+  struct scan_target *target = 0;
+  struct timespec now_tp;
+
+  slots = calloc((size_t) concurrency, sizeof(*slots));
+  free_slots = calloc((size_t) concurrency, sizeof(*free_slots));
+  polled = calloc((size_t) concurrency, sizeof(*polled));
+  pfds = calloc((size_t) concurrency, sizeof(*pfds));
+
+  if(!slots || !free_slots || !polled || !pfds)
+    {
+      rc = -1;
+      goto done_label;
+    }
+
+  for(i = 0; i < (size_t) concurrency; i++)
+    {
+      ez_ntp_query_init(&slots[i].query);
+      slots[i].query.fast_open = fast_open;
+      free_slots[free_count++] = (size_t) concurrency - 1 - i;
+    }
+
+  for(;;)
+    {
+      /*
+      ** Start queries while slots are available.
+      */
+
+      clock_gettime(CLOCK_MONOTONIC, &now_tp);
+
+      while(free_count > 0 && next < targets_count)
+	{
+	  target = &targets[next];
+
+	  if(target->status == EZ_SCAN_INVALID)
+	    {
+	      next += 1;
+	      continue;
+	    }
+
+	  /*
+	  ** A reset from the slot's previous target does not carry over.
+	  */
+
+	  slot = &slots[free_slots[--free_count]];
+	  slot->query.fast_open = fast_open;
+	  slot->target = next++;
+	  slot->deadline_tp = now_tp;
+	  slot->deadline_tp.tv_sec += timeout / 1000;
+	  slot->deadline_tp.tv_nsec += (timeout % 1000) * 1000000L;
+
+	  if(slot->deadline_tp.tv_nsec >= 1000000000L)
+	    {
+	      slot->deadline_tp.tv_sec += 1;
+	      slot->deadline_tp.tv_nsec -= 1000000000L;
+	    }
+
+	  if(ez_ntp_query_start(&slot->query, &target->addr) == EZ_NTP_ERROR)
+	    {
+	      target->error = slot->query.error;
+	      target->state = slot->query.state;
+	      target->status = EZ_SCAN_FAILED;
+	      free_slots[free_count++] = (size_t) (slot - slots);
+	      continue;
+	    }
+
+	  active += 1;
+	}
+
+      if(active == 0)
+	break;
+
+      /*
+      ** Wait until the earliest deadline.
+      */
+
+      wait = timeout;
+
+      for(i = 0, n = 0; i < (size_t) concurrency; i++)
+	if(slots[i].query.fd >= 0)
+	  {
+	    pfds[n].events = ez_ntp_query_events(&slots[i].query);
+	    pfds[n].fd = slots[i].query.fd;
+	    pfds[n].revents = 0;
+	    polled[n++] = i;
+
+	    if(remaining_ms(&slots[i].deadline_tp, &now_tp) < wait)
+	      wait = remaining_ms(&slots[i].deadline_tp, &now_tp);
+	  }
+
+      if(poll(pfds, (nfds_t) n, wait < 0 ? 0 : (int) wait) == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+
+	  rc = -1;
+	  goto done_label;
+	}
+
+      clock_gettime(CLOCK_MONOTONIC, &now_tp);
+
+      for(i = 0; i < n; i++)
+	{
+	  slot = &slots[polled[i]];
+	  target = &targets[slot->target];
+
+	  if(pfds[i].revents != 0)
+	    rc = ez_ntp_query_process(&slot->query, pfds[i].revents);
+	  else
+	    rc = EZ_NTP_AGAIN;
+
+	  if(rc == EZ_NTP_AGAIN)
+	    {
+	      if(remaining_ms(&slot->deadline_tp, &now_tp) > 0)
+		continue;
+
+	      ez_ntp_query_cancel(&slot->query);
+	      slot->query.error = ETIMEDOUT;
+	    }
+
+	  target->error = slot->query.error;
+	  target->sample = slot->query.sample;
+	  target->state = slot->query.state;
+	  target->status = slot->query.state == EZ_NTP_STATE_FINISHED ?
+	    EZ_SCAN_DONE : EZ_SCAN_FAILED;
+	  free_slots[free_count++] = polled[i];
+	  active -= 1;
+	}
+
+      rc = 0;
+    }
+
+ done_label:
+
+  if(slots)
+    for(i = 0; i < (size_t) concurrency; i++)
+      ez_ntp_query_cancel(&slots[i].query);
+
+  free(free_slots);
+  free(pfds);
+  free(polled);
+  free(slots);
+  return rc;
+}
+
+static int targets_read(FILE *file)
+{
+  char line[256];
+  char *ptr = 0;
+  size_t allocated = 0;
+  size_t length = 0;
+  struct scan_target *target = 0;
+
+  while(fgets(line, sizeof(line), file) != 0)
+    {
+      /*
+      ** Blank lines and comments are skipped.
+      */
+
+      line[strcspn(line, "#\r\n")] = 0;
+
+      for(ptr = line; *ptr == ' ' || *ptr == '\t'; ptr++)
+	;
+
+      length = strcspn(ptr, " \t");
+      ptr[length] = 0;
+
+      if(length == 0)
+	continue;
+
+      if(targets_count == allocated)
+	{
+	  allocated = allocated == 0 ? 1024 : 2 * allocated;
+
+	  if((target = realloc(targets, allocated * sizeof(*targets))) == 0)
+	    return -1;
+
+	  targets = target;
+	}
+
+      target = &targets[targets_count++];
+      memset(target, 0, sizeof(*target));
+
+      if(length >= sizeof(target->address) ||
+	 ez_ntp_parse_address(ptr, &target->addr) != EZ_NTP_DONE)
+	target->status = EZ_SCAN_INVALID;
+
+      if(length >= sizeof(target->address))
+	length = sizeof(target->address) - 1;
+
+      memcpy(target->address, ptr, length);
+    }
+
+  return ferror(file) ? -1 : 0;
+}
+
+static long remaining_ms(const struct timespec *deadline_tp,
+			 const struct timespec *now_tp)
+{
+  return (long) (deadline_tp->tv_sec - now_tp->tv_sec) * 1000L +
+    (deadline_tp->tv_nsec - now_tp->tv_nsec) / 1000000L;
+}
+
+static void concurrency_limit(void)
+{
+  rlim_t needed = 0;
+  struct rlimit rl;
+
+  /*
+  ** Each outstanding query holds a descriptor.
+  */
+
+  if((size_t) concurrency > targets_count)
+    concurrency = targets_count > 0 ? (long) targets_count : 1;
+
+  needed = (rlim_t) concurrency + 16;
+
+  if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= needed)
+    return;
+
+  rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed ?
+    rl.rlim_max : needed;
+  setrlimit(RLIMIT_NOFILE, &rl);
+
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < needed)
+    {
+      concurrency = rl.rlim_cur > 17 ? (long) (rl.rlim_cur - 16) : 1;
+      fprintf(stderr, "The descriptor limit reduces the concurrency to "
+	      "%ld.\n", concurrency);
+    }
+}
+
+static void print_quoted(const char *str)
+{
+  const char *ptr = 0;
+
+  /*
+  ** CSV doubles quotation marks. JSON escapes them, backslashes and
+  ** control characters.
+  */
+
+  putchar('"');
+
+  for(ptr = str; *ptr != 0; ptr++)
+    if(*ptr == '"')
+      fputs(json ? "\\\"" : "\"\"", stdout);
+    else if(json && *ptr == '\\')
+      fputs("\\\\", stdout);
+    else if(json && (unsigned char) *ptr < 0x20)
+      printf("\\u%04x", (unsigned int) (unsigned char) *ptr);
+    else
+      putchar(*ptr);
+
+  putchar('"');
+}
+
+static void print_results(void)
+{
+  char status[128];
+  const struct scan_target *target = 0;
+  size_t i = 0;
+
+  if(json)
+    printf("%s", "[");
+  else
+    printf("%s", "address,status,stratum,offset_usec,delay_usec,"
+	   "error_usec\n");
+
+  for(i = 0; i < targets_count; i++)
+    {
+      target = &targets[i];
+      scan_status(target, status, sizeof(status));
+
+      if(json)
+	{
+	  printf("%s\n  {\"address\": ", i > 0 ? "," : "");
+	  print_quoted(target->address);
+	  printf("%s", ", \"status\": ");
+	  print_quoted(status);
+
+	  if(target->status == EZ_SCAN_DONE)
+	    printf(", \"stratum\": %d, \"offset_usec\": %ld, "
+		   "\"delay_usec\": %ld, \"error_usec\": %ld}",
+		   target->sample.response.stratum, target->sample.offset,
+		   target->sample.delay, target->sample.response.error);
+	  else
+	    printf("%s", ", \"stratum\": null, \"offset_usec\": null, "
+		   "\"delay_usec\": null, \"error_usec\": null}");
+	}
+      else
+	{
+	  print_quoted(target->address);
+	  putchar(',');
+	  print_quoted(status);
+
+	  if(target->status == EZ_SCAN_DONE)
+	    printf(",%d,%ld,%ld,%ld\n", target->sample.response.stratum,
+		   target->sample.offset, target->sample.delay,
+		   target->sample.response.error);
+	  else
+	    printf("%s", ",,,,\n");
+	}
+    }
+
+  if(json)
+    printf("%s", targets_count > 0 ? "\n]\n" : "]\n");
+}
+
+static void scan_status(const struct scan_target *target, char *buffer,
+			size_t size)
+{
+  const char *step = 0;
+
+  step = target->state == EZ_NTP_STATE_CONNECTING ? "connect" : "receive";
+
+  if(target->status == EZ_SCAN_INVALID)
+    snprintf(buffer, size, "%s", "invalid address");
+  else if(target->status == EZ_SCAN_DONE)
+    snprintf(buffer, size, "%s",
+	     target->sample.response.stratum >= EZ_NTP_MAX_STRATUM ?
+	     "unsynchronized" : "ok");
+  else if(target->error == ETIMEDOUT)
+    snprintf(buffer, size, "%s timeout", step);
+  else if(target->error == EPROTO)
+    snprintf(buffer, size, "%s", "invalid response");
+  else
+    snprintf(buffer, size, "%s error, %s", step, strerror(target->error));
+}
@@ -0,0 +1,177 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ez_ntp_shm_h_
+#define _ez_ntp_shm_h_
+
+/*
+** The page published by ez-ntpc --shm PATH. Readers map the file and
+** call ez_ntp_shm_read() or ez_ntp_shm_now(). The writer increments
+** sequence before and after every update, so an odd value, or a value
+** that changes during a read, signals a torn snapshot.
+*/
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define EZ_NTP_SHM_MAGIC 0x657a6e74U /* eznt */
+#define EZ_NTP_SHM_PHI 15 /* Frequency tolerance, parts per million. */
+#define EZ_NTP_SHM_SYNCHRONIZED 1
+#define EZ_NTP_SHM_UNSYNCHRONIZED 0
+#define EZ_NTP_SHM_VERSION 1U
+
+struct ez_ntp_shm
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;
+  int32_t status;
+  int64_t error;  /* Microseconds, at the time of the update. */
+  int64_t offset; /* Microseconds, add to the local clock. */
+  int64_t update_sec;
+  int64_t update_usec;
+};
+
+struct ez_ntp_shm_snapshot
+{
+  int status;
+  int64_t error;
+  int64_t offset;
+  struct timeval update_tp;
+};
+
+static inline struct ez_ntp_shm *ez_ntp_shm_open(const char *path)
+{
+  int fd = -1;
+  void *page = 0;
+
+  if((fd = open(path, O_RDONLY)) == -1)
+    return 0;
+
+  page = mmap(0, sizeof(struct ez_ntp_shm), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(page == MAP_FAILED)
+    return 0;
+
+  if(((struct ez_ntp_shm *) page)->magic != EZ_NTP_SHM_MAGIC ||
+     ((struct ez_ntp_shm *) page)->version != EZ_NTP_SHM_VERSION)
+    {
+      munmap(page, sizeof(struct ez_ntp_shm));
+      return 0;
+    }
+
+  return (struct ez_ntp_shm *) page;
+}
+
+static inline void ez_ntp_shm_close(struct ez_ntp_shm *shm)
+{
+  if(shm)
+    munmap((void *) shm, sizeof(struct ez_ntp_shm));
+}
+
+/*
+** Returns 0 on success and -1 if a consistent snapshot could not be
+** obtained after a few attempts.
+*/
+
+static inline int ez_ntp_shm_read(const struct ez_ntp_shm *shm,
+				  struct ez_ntp_shm_snapshot *snapshot)
+{
+  int i = 0;
+  uint32_t sequence1 = 0;
+  uint32_t sequence2 = 0;
+
+  if(!shm || !snapshot)
+    return -1;
+
+  for(i = 0; i < 64; i++)
+    {
+      sequence1 = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+
+      if(sequence1 & 1U)
+	continue;
+
+      snapshot->status = __atomic_load_n(&shm->status, __ATOMIC_RELAXED);
+      snapshot->error = __atomic_load_n(&shm->error, __ATOMIC_RELAXED);
+      snapshot->offset = __atomic_load_n(&shm->offset, __ATOMIC_RELAXED);
+      snapshot->update_tp.tv_sec = (time_t) __atomic_load_n
+	(&shm->update_sec, __ATOMIC_RELAXED);
+      snapshot->update_tp.tv_usec = (suseconds_t) __atomic_load_n
+	(&shm->update_usec, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      sequence2 = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+
+      if(sequence1 == sequence2)
+	return 0;
+    }
+
+  return -1;
+}
+
+/*
+** The corrected time and its uncertainty (microseconds). The
+** uncertainty grows with the age of the estimate. Returns the status
+** of the estimate or -1.
+*/
+
+static inline int ez_ntp_shm_now(const struct ez_ntp_shm *shm,
+				 struct timeval *tp, int64_t *error)
+{
+  int64_t age = 0;
+  int64_t now = 0;
+  struct ez_ntp_shm_snapshot snapshot;
+
+  if(!tp || ez_ntp_shm_read(shm, &snapshot) != 0)
+    return -1;
+
+  if(gettimeofday(tp, 0) != 0)
+    return -1;
+
+  now = (int64_t) tp->tv_sec * 1000000 + (int64_t) tp->tv_usec;
+  age = now - ((int64_t) snapshot.update_tp.tv_sec * 1000000 +
+	       (int64_t) snapshot.update_tp.tv_usec);
+  now += snapshot.offset;
+  tp->tv_sec = (time_t) (now / 1000000);
+  tp->tv_usec = (suseconds_t) (now % 1000000);
+
+  if(tp->tv_usec < 0)
+    {
+      tp->tv_sec -= 1;
+      tp->tv_usec += 1000000;
+    }
+
+  if(error)
+    *error = snapshot.error + (age > 0 ? age * EZ_NTP_SHM_PHI / 1000000 : 0);
+
+  return snapshot.status;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+** ez-ntp-trace, the decoder of trace rings written by ez-ntpc and ez-ntpd.
+** The intact records are written to the standard output as CSV, oldest
+** first. Records which are overwritten while they are read are skipped.
+*/
+
+/*
+** -- System Includes --
+*/
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+** -- Local Includes --
+*/
+
+#include "ez-ntp-trace.h"
+
+static const char *actions[] =
+  {
+    "", "failed", "holdover", "none", "rejected", "served", "slew", "step",
+    "unsynchronized", "upstream"
+  };
+
+static void print_time(int64_t);
+
+int main(int argc, char *argv[])
+{
+  char address[INET_ADDRSTRLEN];
+  struct ez_ntp_trace *trace = 0;
+  struct ez_ntp_trace_record record;
+  struct in_addr addr;
+  uint64_t first = 0;
+  uint64_t head = 0;
+  uint64_t n = 0;
+  unsigned long skipped = 0;
+
+  if(argc != 2)
+    {
+      fprintf(stderr, "%s", "Usage: ez-ntp-trace PATH.\n");
+      return EXIT_FAILURE;
+    }
+
+  if((trace = ez_ntp_trace_open(argv[1])) == 0)
+    {
+      fprintf(stderr, "Unable to open the trace %s, exiting.\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+
+  head = ez_ntp_trace_head(trace);
+  first = head > trace->header.capacity ? head - trace->header.capacity : 0;
+  printf("%s", "sequence,action,address,port,state,stratum,transmit,"
+	 "receive,server,offset_usec,delay_usec,value\n");
+
+  for(n = first; n < head; n++)
+    {
+      if(ez_ntp_trace_read(trace, n, &record) != 0)
+	{
+	  skipped += 1;
+	  continue;
+	}
+
+      addr.s_addr = record.address;
+
+      if(inet_ntop(AF_INET, &addr, address, sizeof(address)) == 0)
+	address[0] = 0;
+
+      printf("%" PRIu64 ",%s,%s,%u,%u,%d,", n,
+	     record.action > 0 &&
+	     (size_t) record.action < sizeof(actions) / sizeof(actions[0]) ?
+	     actions[record.action] : "unknown", address,
+	     (unsigned int) ntohs(record.port), (unsigned int) record.state,
+	     (int) record.stratum);
+      print_time(record.transmit_usec);
+      putchar(',');
+      print_time(record.receive_usec);
+      putchar(',');
+      print_time(record.server_usec);
+      printf(",%" PRId64 ",%" PRId64 ",%" PRId64 "\n", record.offset,
+	     record.delay, record.value);
+    }
+
+  if(skipped > 0)
+    fprintf(stderr, "%lu records were overwritten while reading.\n",
+	    skipped);
+
+  ez_ntp_trace_close(trace);
+  return EXIT_SUCCESS;
+}
+
+static void print_time(int64_t usec)
+{
+  /*
+  ** Seconds and microseconds since the epoch, empty if absent.
+  */
+
+  if(usec == 0)
+    return;
+
+  if(usec < 0)
+    {
+      putchar('-');
+      usec = -usec;
+    }
+
+  printf("%" PRId64 ".%06" PRId64, usec / 1000000, usec % 1000000);
+}
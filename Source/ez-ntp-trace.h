@@ -0,0 +1,340 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ez_ntp_trace_h_
+#define _ez_ntp_trace_h_
+
+/*
+** The trace ring written by ez-ntpc and ez-ntpd --trace PATH. The file
+** holds a header and capacity fixed-size records, capacity being a power
+** of two so that the sequence, head + 1 truncated to 32 bits, selects the
+** same record as head across the wrap. Writers claim record
+** head % capacity by incrementing head and stamp the record's sequence
+** with head + 1 once it is complete; a sequence of zero marks a record
+** being written. Readers, such as ez-ntp-trace, map the file and call
+** ez_ntp_trace_read().
+**
+** Times are microseconds since the epoch on the writer's clock.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define EZ_NTP_TRACE_FAILED 1 /* value is an errno value. */
+#define EZ_NTP_TRACE_HOLDOVER 2 /* value is the error bound. */
+#define EZ_NTP_TRACE_MAGIC 0x657a7472U /* eztr */
+#define EZ_NTP_TRACE_MAX_RECORDS 16777216U
+#define EZ_NTP_TRACE_MIN_RECORDS 1024U
+#define EZ_NTP_TRACE_NONE 3
+#define EZ_NTP_TRACE_REJECTED 4
+#define EZ_NTP_TRACE_SERVED 5
+#define EZ_NTP_TRACE_SLEW 6 /* value is the slew. */
+#define EZ_NTP_TRACE_STEP 7 /* value is the step. */
+#define EZ_NTP_TRACE_UNSYNCHRONIZED 8
+#define EZ_NTP_TRACE_UPSTREAM 9
+#define EZ_NTP_TRACE_VERSION 1U
+
+struct ez_ntp_trace_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint64_t head; /* The number of records ever claimed. */
+  uint8_t reserved[40];
+};
+
+struct ez_ntp_trace_record
+{
+  int64_t transmit_usec; /* Before connect(), or after send(). */
+  int64_t receive_usec; /* After the response was read. */
+  int64_t server_usec; /* The server's stamp. */
+  int64_t offset; /* Microseconds. */
+  int64_t delay; /* Microseconds. */
+  int64_t value;
+  uint32_t sequence;
+  int16_t action;
+  int16_t stratum;
+  uint32_t address; /* The peer, network byte order. */
+  uint16_t port; /* The peer, network byte order. */
+  uint16_t state; /* The query's state if it failed. */
+};
+
+struct ez_ntp_trace
+{
+  struct ez_ntp_trace_header header;
+  struct ez_ntp_trace_record records[];
+};
+
+static inline int ez_ntp_trace_capacity_valid(uint32_t capacity)
+{
+  return capacity >= EZ_NTP_TRACE_MIN_RECORDS &&
+    capacity <= EZ_NTP_TRACE_MAX_RECORDS &&
+    (capacity & (capacity - 1)) == 0;
+}
+
+static inline size_t ez_ntp_trace_size(uint32_t capacity)
+{
+  return sizeof(struct ez_ntp_trace_header) +
+    (size_t) capacity * sizeof(struct ez_ntp_trace_record);
+}
+
+/*
+** Returns 1 if the header describes a complete ring of the file's size.
+*/
+
+static inline int ez_ntp_trace_valid(const struct ez_ntp_trace_header *header,
+				     off_t size)
+{
+  return header->magic == EZ_NTP_TRACE_MAGIC &&
+    header->version == EZ_NTP_TRACE_VERSION &&
+    header->record_size == sizeof(struct ez_ntp_trace_record) &&
+    ez_ntp_trace_capacity_valid(header->capacity) &&
+    (size_t) size == ez_ntp_trace_size(header->capacity);
+}
+
+/*
+** Writers. An existing ring of the same capacity is continued. A new or
+** empty file is initialized. A ring of another capacity or version, or
+** one whose initialization was interrupted, is replaced by a new file;
+** processes which still map the old one are unaffected. Any other file is
+** left untouched and EINVAL is returned.
+*/
+
+static inline struct ez_ntp_trace *ez_ntp_trace_create(const char *path,
+							uint32_t capacity)
+{
+  char tmp[PATH_MAX];
+  int err = 0;
+  int fd = -1;
+  int n = 0;
+  size_t size = ez_ntp_trace_size(capacity);
+  struct ez_ntp_trace *trace = 0;
+  struct ez_ntp_trace_header header;
+  struct stat st;
+  void *map = 0;
+
+  tmp[0] = 0;
+
+  if(!ez_ntp_trace_capacity_valid(capacity))
+    {
+      errno = EINVAL;
+      return 0;
+    }
+
+  if((fd = open(path, O_CLOEXEC | O_CREAT | O_NOFOLLOW | O_RDWR,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+    return 0;
+
+  if(fstat(fd, &st) != 0)
+    goto error_label;
+
+  if(!S_ISREG(st.st_mode))
+    {
+      errno = EINVAL;
+      goto error_label;
+    }
+
+  memset(&header, 0, sizeof(header));
+
+  if(pread(fd, &header, sizeof(header), 0) == -1)
+    goto error_label;
+
+  if(st.st_size == 0)
+    {
+      if(ftruncate(fd, (off_t) size) != 0)
+	goto error_label;
+    }
+  else if(!ez_ntp_trace_valid(&header, st.st_size) ||
+	  header.capacity != capacity)
+    {
+      /*
+      ** A ring whose initialization was interrupted has a zero magic
+      ** and head and the size of a ring.
+      */
+
+      if(header.magic != EZ_NTP_TRACE_MAGIC &&
+	 !(header.magic == 0 && header.head == 0 &&
+	   st.st_size > (off_t) sizeof(header) &&
+	   ((size_t) st.st_size - sizeof(header)) %
+	   sizeof(struct ez_ntp_trace_record) == 0))
+	{
+	  errno = EINVAL;
+	  goto error_label;
+	}
+
+      close(fd);
+      n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+      if(n < 0 || (size_t) n >= sizeof(tmp))
+	{
+	  errno = ENAMETOOLONG;
+	  return 0;
+	}
+
+      if((fd = mkstemp(tmp)) == -1)
+	return 0;
+
+      if(fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) != 0 ||
+	 ftruncate(fd, (off_t) size) != 0 ||
+	 rename(tmp, path) != 0)
+	goto error_label;
+    }
+
+  map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  err = errno;
+  close(fd);
+
+  if(map == MAP_FAILED)
+    {
+      errno = err;
+      return 0;
+    }
+
+  trace = (struct ez_ntp_trace *) map;
+
+  if(trace->header.magic != EZ_NTP_TRACE_MAGIC)
+    {
+      trace->header.version = EZ_NTP_TRACE_VERSION;
+      trace->header.record_size = sizeof(struct ez_ntp_trace_record);
+      trace->header.capacity = capacity;
+      __atomic_store_n(&trace->header.magic, EZ_NTP_TRACE_MAGIC,
+		       __ATOMIC_RELEASE);
+    }
+
+  return trace;
+
+ error_label:
+  err = errno;
+  close(fd);
+
+  if(tmp[0])
+    unlink(tmp);
+
+  errno = err;
+  return 0;
+}
+
+static inline void ez_ntp_trace_write(struct ez_ntp_trace *trace,
+				      const struct ez_ntp_trace_record *record)
+{
+  struct ez_ntp_trace_record *slot = 0;
+  uint64_t head = 0;
+
+  if(!trace || !record)
+    return;
+
+  head = __atomic_fetch_add(&trace->header.head, 1, __ATOMIC_RELAXED);
+  slot = &trace->records[head & (trace->header.capacity - 1)];
+  __atomic_store_n(&slot->sequence, 0U, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(slot, record, offsetof(struct ez_ntp_trace_record, sequence));
+  memcpy(&slot->action, &record->action,
+	 sizeof(*slot) - offsetof(struct ez_ntp_trace_record, action));
+  __atomic_store_n(&slot->sequence, (uint32_t) (head + 1), __ATOMIC_RELEASE);
+}
+
+/*
+** Readers.
+*/
+
+static inline struct ez_ntp_trace *ez_ntp_trace_open(const char *path)
+{
+  int fd = -1;
+  struct ez_ntp_trace_header header;
+  struct stat st;
+  void *map = 0;
+
+  if((fd = open(path, O_RDONLY)) == -1)
+    return 0;
+
+  if(fstat(fd, &st) != 0 ||
+     read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) ||
+     !ez_ntp_trace_valid(&header, st.st_size))
+    {
+      close(fd);
+      return 0;
+    }
+
+  map = mmap(0, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return map == MAP_FAILED ? 0 : (struct ez_ntp_trace *) map;
+}
+
+static inline void ez_ntp_trace_close(struct ez_ntp_trace *trace)
+{
+  if(trace)
+    munmap((void *) trace, ez_ntp_trace_size(trace->header.capacity));
+}
+
+static inline uint64_t ez_ntp_trace_head(const struct ez_ntp_trace *trace)
+{
+  return trace ? __atomic_load_n(&trace->header.head, __ATOMIC_ACQUIRE) : 0;
+}
+
+/*
+** Copies record number n. Returns 0 on success and -1 if the record has
+** been overwritten or is being written.
+*/
+
+static inline int ez_ntp_trace_read(const struct ez_ntp_trace *trace,
+				    uint64_t n,
+				    struct ez_ntp_trace_record *record)
+{
+  const struct ez_ntp_trace_record *slot = 0;
+
+  if(!trace || !record)
+    return -1;
+
+  slot = &trace->records[n & (trace->header.capacity - 1)];
+
+  if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) !=
+     (uint32_t) (n + 1))
+    return -1;
+
+  *record = *slot;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) !=
+     (uint32_t) (n + 1))
+    return -1;
+
+  record->sequence = (uint32_t) (n + 1);
+  return 0;
+}
+
+#endif
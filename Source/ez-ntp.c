@@ -0,0 +1,1128 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+** -- System Includes --
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define EZ_NTP_TSC 1
+#endif
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#endif
+
+/*
+** -- Local Includes --
+*/
+
+#include "ez-ntp.h"
+
+/*
+** Decimal digits in pairs, "00" through "99".
+*/
+
+static const char digit_pairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/*
+** TSC stamps. Wall time is base_ns plus (ticks - base_ticks) * scale
+** >> EZ_NTP_TSC_SHIFT, valid for EZ_NTP_TSC_VALIDITY seconds of ticks
+** past the base. The conversion is published under a sequence lock;
+** readers retry while the sequence is odd or changes. Every
+** EZ_NTP_TSC_INTERVAL seconds the TSC is measured against CLOCK_MONOTONIC,
+** which steps do not disturb, for the scale and against CLOCK_REALTIME for
+** the base. A frequency change of more than EZ_NTP_TSC_TOLERANCE between
+** measurements disables the TSC. A refresh does not move the time
+** already extrapolated: a difference of up to EZ_NTP_TSC_SLEW nanoseconds
+** is slewed in over the next interval. On Linux, a step by any process
+** wakes the refresh thread, which moves the base at once.
+*/
+
+#define EZ_NTP_TSC_CALIBRATION 50000000L /* Nanoseconds. */
+#define EZ_NTP_TSC_INTERVAL 1 /* Seconds. */
+#define EZ_NTP_TSC_SHIFT 32
+#define EZ_NTP_TSC_SLEW 1000000L /* Nanoseconds. */
+#define EZ_NTP_TSC_TOLERANCE 1000.0 /* Parts per million. */
+#define EZ_NTP_TSC_TRIES 5
+#define EZ_NTP_TSC_VALIDITY (3 * EZ_NTP_TSC_INTERVAL) /* Seconds. */
+
+struct tsc_clock
+{
+  int active;
+  int64_t base_ns;
+  uint32_t sequence;
+  uint64_t base_ticks;
+  uint64_t limit;
+  uint64_t scale;
+};
+
+struct tsc_point
+{
+  int64_t monotonic_ns;
+  int64_t realtime_ns;
+  uint64_t monotonic_ticks;
+  uint64_t realtime_ticks;
+};
+
+static struct tsc_clock tsc;
+static int query_fail(struct ez_ntp_query *, int);
+static size_t format_long(char *, size_t, long);
+static void query_close(struct ez_ntp_query *);
+#if defined(EZ_NTP_TSC)
+static double tsc_hz = 0.0; /* Ticks per nanosecond. */
+static pthread_mutex_t tsc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static double tsc_difference(double, double);
+static double tsc_frequency(const struct tsc_point *,
+			    const struct tsc_point *);
+static int tsc_measure(clockid_t, uint64_t *, int64_t *);
+static int tsc_point(struct tsc_point *);
+static int tsc_wait(int);
+static void *tsc_fun(void *);
+static void tsc_publish(const struct tsc_point *, double);
+#endif
+
+int ez_ntp_format(char *buffer, size_t size,
+		  const struct ez_ntp_response *response, int fields)
+{
+  long values[8];
+  size_t i = 0;
+  size_t length = 0;
+  size_t n = 0;
+
+  if(!buffer || !response || (fields != 2 && fields != 4 && fields != 8))
+    return -1;
+
+  values[0] = (long) response->server_tp.tv_sec;
+  values[1] = (long) response->server_tp.tv_usec;
+  values[2] = (long) response->stratum;
+  values[3] = response->error;
+  values[4] = (long) response->previous_tp.tv_sec;
+  values[5] = (long) response->previous_tp.tv_usec;
+  values[6] = (long) response->previous_transmit_tp.tv_sec;
+  values[7] = (long) response->previous_transmit_tp.tv_usec;
+
+  for(i = 0; i < (size_t) fields; i++)
+    {
+      if(i > 0)
+	{
+	  if(length >= size)
+	    return -1;
+
+	  buffer[length++] = ',';
+	}
+
+      if((n = format_long(buffer + length, size - length, values[i])) == 0)
+	return -1;
+
+      length += n;
+    }
+
+  if(size - length < 3)
+    return -1;
+
+  buffer[length++] = '\r';
+  buffer[length++] = '\n';
+  buffer[length] = 0;
+  return (int) length;
+}
+
+int ez_ntp_gettime(struct timeval *tp)
+{
+#if defined(EZ_NTP_TSC)
+  int64_t base_ns = 0;
+  int64_t ns = 0;
+  uint32_t sequence = 0;
+  uint64_t base_ticks = 0;
+  uint64_t limit = 0;
+  uint64_t scale = 0;
+  uint64_t ticks = 0;
+
+  if(tp && __atomic_load_n(&tsc.active, __ATOMIC_RELAXED))
+    {
+      ticks = __rdtsc();
+
+      do
+	{
+	  sequence = __atomic_load_n(&tsc.sequence, __ATOMIC_ACQUIRE);
+	  base_ticks = __atomic_load_n(&tsc.base_ticks, __ATOMIC_RELAXED);
+	  base_ns = __atomic_load_n(&tsc.base_ns, __ATOMIC_RELAXED);
+	  limit = __atomic_load_n(&tsc.limit, __ATOMIC_RELAXED);
+	  scale = __atomic_load_n(&tsc.scale, __ATOMIC_RELAXED);
+	  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+      while((sequence & 1) != 0 ||
+	    sequence != __atomic_load_n(&tsc.sequence, __ATOMIC_RELAXED));
+
+      /*
+      ** A counter read just before a refresh published its base lies
+      ** behind the base. A stalled refresh thread falls back to the
+      ** system call.
+      */
+
+      if(ticks >= base_ticks && ticks - base_ticks <= limit)
+	ns = base_ns +
+	  (int64_t) (((ticks - base_ticks) * scale) >> EZ_NTP_TSC_SHIFT);
+      else if(ticks < base_ticks && base_ticks - ticks <= limit)
+	ns = base_ns -
+	  (int64_t) ((((base_ticks - ticks) * scale) +
+		      (1ULL << EZ_NTP_TSC_SHIFT) - 1) >> EZ_NTP_TSC_SHIFT);
+      else
+	return gettimeofday(tp, 0);
+
+      tp->tv_sec = (time_t) (ns / 1000000000);
+      tp->tv_usec = (suseconds_t) (ns % 1000000000 / 1000);
+      return 0;
+    }
+#endif
+
+  return gettimeofday(tp, 0);
+}
+
+int ez_ntp_multicast_open(const struct sockaddr_in *group)
+{
+  int err = 0;
+  int fd = -1;
+  int tmpint = 1;
+  struct ip_mreq mreq;
+  struct sockaddr_in addr;
+
+  if(!group)
+    return -1;
+
+  if((fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &tmpint, sizeof(tmpint));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_family = AF_INET;
+  addr.sin_port = group->sin_port;
+
+  if(bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) != 0)
+    goto error_label;
+
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  mreq.imr_multiaddr = group->sin_addr;
+
+  if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+    goto error_label;
+
+  return fd;
+
+ error_label:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+int ez_ntp_multicast_receive(int fd, struct ez_ntp_sample *sample)
+{
+  char buffer[2 * sizeof(long unsigned int) + 64];
+  ssize_t rc = 0;
+  struct timeval tp;
+
+  if(fd < 0 || !sample)
+    return EZ_NTP_ERROR;
+
+  if((rc = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) == -1)
+    {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return EZ_NTP_AGAIN;
+      else
+	return EZ_NTP_ERROR;
+    }
+
+  ez_ntp_gettime(&tp);
+  memset(sample, 0, sizeof(*sample));
+  sample->receive_tp = tp;
+  sample->transmit_tp = tp;
+
+  if(ez_ntp_parse(buffer, (size_t) rc, &sample->response) != EZ_NTP_DONE)
+    {
+      errno = EPROTO;
+      return EZ_NTP_ERROR;
+    }
+
+  ez_ntp_sample_compute(sample);
+  return EZ_NTP_DONE;
+}
+
+int ez_ntp_parse(const char *buffer, size_t length,
+		 struct ez_ntp_response *response)
+{
+  const char *end = 0;
+  const char *ptr = 0;
+  int negative = 0;
+  long digit = 0;
+  long values[8];
+  size_t count = 0;
+
+  if(!buffer || !response)
+    return EZ_NTP_ERROR;
+
+  memset(response, 0, sizeof(*response));
+  end = buffer + length;
+  ptr = buffer;
+
+  /*
+  ** A single pass over decimal fields separated by commas and terminated
+  ** by \r\n. Only the seconds may be negative.
+  */
+
+  for(;;)
+    {
+      negative = count == 0 && ptr < end && *ptr == '-';
+
+      if(negative)
+	ptr++;
+
+      if(ptr >= end || *ptr < '0' || *ptr > '9')
+	return EZ_NTP_ERROR;
+
+      values[count] = 0;
+
+      while(ptr < end && *ptr >= '0' && *ptr <= '9')
+	{
+	  digit = *ptr++ - '0';
+
+	  if(values[count] > (LONG_MAX - digit) / 10)
+	    return EZ_NTP_ERROR;
+
+	  values[count] = values[count] * 10 + digit;
+	}
+
+      if(negative)
+	values[count] = -values[count];
+
+      count += 1;
+
+      if(ptr < end && *ptr == ',' && count < 8)
+	ptr++;
+      else if(end - ptr >= 2 && ptr[0] == '\r' && ptr[1] == '\n')
+	break;
+      else
+	return EZ_NTP_ERROR;
+    }
+
+  if(count != 2 && count != 4 && count != 8)
+    return EZ_NTP_ERROR;
+
+  if(values[1] >= 1000000L ||
+     (count > 2 && values[2] > EZ_NTP_MAX_STRATUM) ||
+     (count > 4 && (values[5] >= 1000000L || values[7] >= 1000000L)))
+    return EZ_NTP_ERROR;
+
+  response->server_tp.tv_sec = (time_t) values[0];
+  response->server_tp.tv_usec = (suseconds_t) values[1];
+
+  if(count > 2)
+    {
+      response->stratum = (int) values[2];
+      response->error = values[3];
+    }
+
+  if(count > 4)
+    {
+      response->interleaved = 1;
+      response->previous_tp.tv_sec = (time_t) values[4];
+      response->previous_tp.tv_usec = (suseconds_t) values[5];
+      response->previous_transmit_tp.tv_sec = (time_t) values[6];
+      response->previous_transmit_tp.tv_usec = (suseconds_t) values[7];
+    }
+
+  return EZ_NTP_DONE;
+}
+
+int ez_ntp_parse_address(const char *str, struct sockaddr_in *addr)
+{
+  char *endptr;
+  char host[128];
+  const char *colon = 0;
+  long port_num = -1;
+  size_t length = 0;
+
+  /*
+  ** IP-ADDRESS:PORT.
+  */
+
+  if(!str || !addr)
+    return EZ_NTP_ERROR;
+
+  if((colon = strrchr(str, ':')) == 0)
+    return EZ_NTP_ERROR;
+
+  length = (size_t) (colon - str);
+
+  if(length == 0 || length >= sizeof(host))
+    return EZ_NTP_ERROR;
+
+  memset(host, 0, sizeof(host));
+  memcpy(host, str, length);
+  errno = 0;
+  port_num = strtol(colon + 1, &endptr, 10);
+
+  if(errno == EINVAL || errno == ERANGE || endptr == colon + 1 ||
+     *endptr != 0 || port_num <= 0 || port_num > 65535)
+    return EZ_NTP_ERROR;
+
+  memset(addr, 0, sizeof(*addr));
+
+  if(inet_pton(AF_INET, host, &addr->sin_addr) != 1)
+    return EZ_NTP_ERROR;
+
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons((uint16_t) port_num);
+  return EZ_NTP_DONE;
+}
+
+int ez_ntp_query_fd(const struct ez_ntp_query *query)
+{
+  if(!query)
+    return -1;
+
+  return query->fd;
+}
+
+int ez_ntp_query_process(struct ez_ntp_query *query, short revents)
+{
+  int err = 0;
+  socklen_t length = 0;
+  ssize_t rc = 0;
+
+  if(!query || query->fd < 0)
+    return EZ_NTP_ERROR;
+
+  if(query->state == EZ_NTP_STATE_CONNECTING)
+    {
+      if(!(revents & (POLLERR | POLLHUP | POLLOUT)))
+	return EZ_NTP_AGAIN;
+
+      length = sizeof(err);
+
+      if(getsockopt(query->fd, SOL_SOCKET, SO_ERROR, &err, &length) != 0)
+	return query_fail(query, errno);
+      else if(err != 0)
+	return query_fail(query, err);
+
+      query->state = EZ_NTP_STATE_READING;
+      return EZ_NTP_AGAIN;
+    }
+
+  if(query->state != EZ_NTP_STATE_READING)
+    return EZ_NTP_ERROR;
+
+  for(;;)
+    {
+      if(query->length >= sizeof(query->buffer) - 1)
+	return query_fail(query, EPROTO);
+
+      rc = recv(query->fd, query->buffer + query->length,
+		sizeof(query->buffer) - 1 - query->length, 0);
+
+      if(rc == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  else if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    return EZ_NTP_AGAIN;
+	  else
+	    return query_fail(query, errno);
+	}
+      else if(rc == 0)
+	return query_fail(query, EPROTO);
+
+      query->length += (size_t) rc;
+
+      /*
+      ** Only the new bytes may complete the line.
+      */
+
+      if(memchr(query->buffer + query->length - (size_t) rc, '\n',
+		(size_t) rc) != 0)
+	break;
+    }
+
+  ez_ntp_gettime(&query->sample.receive_tp);
+  query_close(query);
+
+  if(ez_ntp_parse(query->buffer, query->length,
+		  &query->sample.response) != EZ_NTP_DONE)
+    {
+      query->error = EPROTO;
+      return EZ_NTP_ERROR;
+    }
+
+  ez_ntp_sample_compute(&query->sample);
+  query->state = EZ_NTP_STATE_FINISHED;
+  return EZ_NTP_DONE;
+}
+
+int ez_ntp_query_start(struct ez_ntp_query *query,
+		       const struct sockaddr_in *addr)
+{
+  int flags = 0;
+
+  if(!query || !addr)
+    return EZ_NTP_ERROR;
+
+  query_close(query);
+  memset(query->buffer, 0, sizeof(query->buffer));
+  memset(&query->sample, 0, sizeof(query->sample));
+  query->error = 0;
+  query->fast_opened = 0;
+  query->length = 0;
+  query->state = EZ_NTP_STATE_CONNECTING;
+
+  if((query->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    return query_fail(query, errno);
+
+  if((flags = fcntl(query->fd, F_GETFL, 0)) == -1 ||
+     fcntl(query->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return query_fail(query, errno);
+
+  ez_ntp_gettime(&query->sample.transmit_tp);
+
+#if defined(MSG_FASTOPEN)
+  if(query->fast_open)
+    {
+      /*
+      ** sendto() connects. Without a cookie, the SYN requests one, the
+      ** payload is not sent and the query continues as a plain
+      ** connection, which sends nothing.
+      */
+
+      if(sendto(query->fd, EZ_NTP_REQUEST, strlen(EZ_NTP_REQUEST),
+		MSG_FASTOPEN, (const struct sockaddr *) addr,
+		sizeof(*addr)) >= 0)
+	{
+	  query->fast_opened = 1;
+	  return EZ_NTP_AGAIN;
+	}
+      else if(errno == EINPROGRESS)
+	return EZ_NTP_AGAIN;
+      else if(errno != EOPNOTSUPP)
+	return query_fail(query, errno);
+    }
+#endif
+
+  if(connect(query->fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0)
+    query->state = EZ_NTP_STATE_READING;
+  else if(errno != EINPROGRESS)
+    return query_fail(query, errno);
+
+  return EZ_NTP_AGAIN;
+}
+
+int ez_ntp_query_wait(struct ez_ntp_query *query, int timeout)
+{
+  int rc = 0;
+  struct pollfd pfd;
+
+  if(!query)
+    return EZ_NTP_ERROR;
+
+  /*
+  ** The timeout, in milliseconds, applies to each step.
+  */
+
+  for(rc = EZ_NTP_AGAIN; rc == EZ_NTP_AGAIN;)
+    {
+      pfd.fd = query->fd;
+      pfd.events = ez_ntp_query_events(query);
+      pfd.revents = 0;
+
+      if(pfd.fd < 0)
+	return EZ_NTP_ERROR;
+
+      rc = poll(&pfd, 1, timeout);
+
+      if(rc == -1 && errno == EINTR)
+	rc = EZ_NTP_AGAIN;
+      else if(rc == -1)
+	return query_fail(query, errno);
+      else if(rc == 0)
+	return query_fail(query, ETIMEDOUT);
+      else
+	rc = ez_ntp_query_process(query, pfd.revents);
+    }
+
+  return rc;
+}
+
+long ez_ntp_timeval_to_usec(const struct timeval *tp)
+{
+  if(!tp)
+    return 0;
+
+  return (long) tp->tv_sec * 1000000L + (long) tp->tv_usec;
+}
+
+short ez_ntp_query_events(const struct ez_ntp_query *query)
+{
+  if(!query)
+    return 0;
+  else if(query->state == EZ_NTP_STATE_CONNECTING)
+    return POLLOUT;
+  else if(query->state == EZ_NTP_STATE_READING)
+    return POLLIN;
+  else
+    return 0;
+}
+
+void ez_ntp_query_cancel(struct ez_ntp_query *query)
+{
+  query_close(query);
+}
+
+void ez_ntp_query_init(struct ez_ntp_query *query)
+{
+  if(!query)
+    return;
+
+  memset(query, 0, sizeof(*query));
+  query->fd = -1;
+  query->so_linger = -1;
+  query->state = EZ_NTP_STATE_IDLE;
+}
+
+void ez_ntp_sample_compute(struct ez_ntp_sample *sample)
+{
+  struct timeval tp;
+
+  if(!sample)
+    return;
+
+  /*
+  ** The server's stamp is assumed to lie halfway through the exchange.
+  */
+
+  timersub(&sample->receive_tp, &sample->transmit_tp, &tp);
+  sample->delay = ez_ntp_timeval_to_usec(&tp);
+  timersub(&sample->response.server_tp, &sample->transmit_tp, &tp);
+  sample->offset = ez_ntp_timeval_to_usec(&tp) - sample->delay / 2;
+}
+
+int ez_ntp_sample_interleave(struct ez_ntp_sample *previous,
+			     const struct ez_ntp_sample *current)
+{
+  if(!previous || !current || !current->response.interleaved)
+    return EZ_NTP_ERROR;
+
+  /*
+  ** The server's record must describe this client's previous exchange.
+  */
+
+  if(current->response.previous_transmit_tp.tv_sec == 0 ||
+     !timercmp(&current->response.previous_tp,
+	       &previous->response.server_tp, ==) ||
+     timercmp(&current->response.previous_transmit_tp,
+	      &previous->response.server_tp, <))
+    return EZ_NTP_ERROR;
+
+  previous->response.server_tp = current->response.previous_transmit_tp;
+  ez_ntp_sample_compute(previous);
+  return EZ_NTP_DONE;
+}
+
+int ez_ntp_tsc_active(void)
+{
+  return __atomic_load_n(&tsc.active, __ATOMIC_RELAXED);
+}
+
+void ez_ntp_tsc_rebase(void)
+{
+#if defined(EZ_NTP_TSC)
+  struct tsc_point point;
+
+  /*
+  ** The clock was stepped. Keep the scale and move the base.
+  */
+
+  if(!ez_ntp_tsc_active())
+    return;
+
+  memset(&point, 0, sizeof(point));
+
+  if(tsc_measure(CLOCK_REALTIME, &point.realtime_ticks,
+		 &point.realtime_ns) != 0)
+    {
+      __atomic_store_n(&tsc.active, 0, __ATOMIC_RELAXED);
+      return;
+    }
+
+  tsc_publish(&point, 0.0);
+#endif
+}
+
+int ez_ntp_tsc_start(void)
+{
+#if defined(EZ_NTP_TSC)
+  double first = 0.0;
+  double second = 0.0;
+  int rc = 0;
+  pthread_t thread;
+  sigset_t mask;
+  sigset_t saved;
+  static struct tsc_point points[3];
+  struct timespec ts;
+  unsigned int eax = 0;
+  unsigned int ebx = 0;
+  unsigned int ecx = 0;
+  unsigned int edx = 0;
+  unsigned int i = 0;
+
+  if(ez_ntp_tsc_active())
+    return 0;
+
+  /*
+  ** The invariant TSC runs at a constant rate in every power state.
+  */
+
+  if(__get_cpuid(0x80000000U, &eax, &ebx, &ecx, &edx) == 0 ||
+     eax < 0x80000007U ||
+     __get_cpuid(0x80000007U, &eax, &ebx, &ecx, &edx) == 0 ||
+     (edx & (1U << 8)) == 0)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  /*
+  ** Two successive windows must agree on the frequency.
+  */
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = EZ_NTP_TSC_CALIBRATION;
+
+  for(i = 0; i < 3; i++)
+    {
+      if(i > 0)
+	nanosleep(&ts, 0);
+
+      if(tsc_point(&points[i]) != 0)
+	{
+	  errno = ENOTSUP;
+	  return -1;
+	}
+    }
+
+  first = tsc_frequency(&points[0], &points[1]);
+  second = tsc_frequency(&points[1], &points[2]);
+
+  if(first <= 0.0 || second <= 0.0 ||
+     tsc_difference(first, second) > EZ_NTP_TSC_TOLERANCE)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  tsc_hz = tsc_frequency(&points[0], &points[2]);
+  tsc_publish(&points[2], tsc_hz);
+  __atomic_store_n(&tsc.active, 1, __ATOMIC_RELAXED);
+
+  /*
+  ** The refresh thread leaves signals to the application's threads.
+  */
+
+  sigfillset(&mask);
+  pthread_sigmask(SIG_SETMASK, &mask, &saved);
+  rc = pthread_create(&thread, 0, tsc_fun, &points[2]);
+  pthread_sigmask(SIG_SETMASK, &saved, 0);
+
+  if(rc != 0)
+    {
+      __atomic_store_n(&tsc.active, 0, __ATOMIC_RELAXED);
+      errno = rc;
+      return -1;
+    }
+
+  pthread_detach(thread);
+  return 0;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+void ez_ntp_usec_to_timeval(long usec, struct timeval *tp)
+{
+  if(!tp)
+    return;
+
+  tp->tv_sec = (time_t) (usec / 1000000L);
+  tp->tv_usec = (suseconds_t) (usec % 1000000L);
+
+  if(tp->tv_usec < 0)
+    {
+      tp->tv_sec -= 1;
+      tp->tv_usec += 1000000L;
+    }
+}
+
+static size_t format_long(char *buffer, size_t size, long value)
+{
+  char tmp[3 * sizeof(long) + 2];
+  char *ptr = tmp + sizeof(tmp);
+  const char *pair = 0;
+  size_t length = 0;
+  unsigned long magnitude = 0;
+
+  /*
+  ** Two digits per division, from the least significant. Returns zero
+  ** if the digits do not fit.
+  */
+
+  magnitude = value < 0 ? 0UL - (unsigned long) value : (unsigned long) value;
+
+  while(magnitude >= 100)
+    {
+      pair = digit_pairs + 2 * (magnitude % 100);
+      magnitude /= 100;
+      *--ptr = pair[1];
+      *--ptr = pair[0];
+    }
+
+  if(magnitude >= 10)
+    {
+      pair = digit_pairs + 2 * magnitude;
+      *--ptr = pair[1];
+      *--ptr = pair[0];
+    }
+  else
+    *--ptr = (char) ('0' + magnitude);
+
+  if(value < 0)
+    *--ptr = '-';
+
+  length = (size_t) (tmp + sizeof(tmp) - ptr);
+
+  if(length > size)
+    return 0;
+
+  memcpy(buffer, ptr, length);
+  return length;
+}
+
+static int query_fail(struct ez_ntp_query *query, int err)
+{
+  query_close(query);
+  query->error = err;
+
+  /*
+  ** A server which does not expect the request in the SYN resets the
+  ** connection. Resets of plain connections say nothing about it.
+  */
+
+  if(query->fast_opened && (err == ECONNRESET || err == EPIPE))
+    query->fast_open = 0;
+
+  return EZ_NTP_ERROR;
+}
+
+static void query_close(struct ez_ntp_query *query)
+{
+  if(!query || query->fd < 0)
+    return;
+
+  if(query->shutdown_before_close)
+    shutdown(query->fd, SHUT_RDWR);
+
+  if(query->so_linger >= 0)
+    {
+      struct linger sol;
+
+      sol.l_onoff = 1;
+      sol.l_linger = query->so_linger;
+      setsockopt(query->fd, SOL_SOCKET, SO_LINGER, &sol, sizeof(sol));
+    }
+
+  close(query->fd);
+  query->fd = -1;
+}
+
+#if defined(EZ_NTP_TSC)
+static double tsc_difference(double a, double b)
+{
+  /*
+  ** Parts per million.
+  */
+
+  return (a > b ? a - b : b - a) / a * 1000000.0;
+}
+
+static double tsc_frequency(const struct tsc_point *a,
+			    const struct tsc_point *b)
+{
+  /*
+  ** Ticks per nanosecond.
+  */
+
+  if(b->monotonic_ns <= a->monotonic_ns ||
+     b->monotonic_ticks <= a->monotonic_ticks)
+    return 0.0;
+
+  return (double) (b->monotonic_ticks - a->monotonic_ticks) /
+    (double) (b->monotonic_ns - a->monotonic_ns);
+}
+
+static int tsc_measure(clockid_t clock, uint64_t *ticks, int64_t *ns)
+{
+  int i = 0;
+  struct timespec ts;
+  uint64_t after = 0;
+  uint64_t before = 0;
+  uint64_t width = UINT64_MAX;
+
+  /*
+  ** Bracket the clock between two TSC reads and keep the narrowest of a
+  ** few attempts.
+  */
+
+  for(i = 0; i < EZ_NTP_TSC_TRIES; i++)
+    {
+      before = __rdtsc();
+
+      if(clock_gettime(clock, &ts) != 0)
+	return -1;
+
+      after = __rdtsc();
+
+      if(after < before)
+	return -1;
+
+      if(after - before < width)
+	{
+	  width = after - before;
+	  *ticks = before + width / 2;
+	  *ns = (int64_t) ts.tv_sec * 1000000000 + (int64_t) ts.tv_nsec;
+	}
+    }
+
+  return 0;
+}
+
+static int tsc_point(struct tsc_point *point)
+{
+  if(tsc_measure(CLOCK_MONOTONIC, &point->monotonic_ticks,
+		 &point->monotonic_ns) != 0 ||
+     tsc_measure(CLOCK_REALTIME, &point->realtime_ticks,
+		 &point->realtime_ns) != 0)
+    return -1;
+
+  return 0;
+}
+
+static void *tsc_fun(void *arg)
+{
+  double current = 0.0;
+  double frequency = 0.0;
+  int fd = -1;
+  int rc = 0;
+  struct tsc_point previous;
+  struct tsc_point point;
+
+  current = tsc_hz;
+  previous = *((const struct tsc_point *) arg);
+#if defined(__linux__) && defined(TFD_TIMER_CANCEL_ON_SET)
+  fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+#endif
+
+  for(;;)
+    {
+      rc = tsc_wait(fd);
+
+      if(!ez_ntp_tsc_active())
+	break;
+
+      if(rc == 1)
+	{
+	  /*
+	  ** The clock was set. The scale is unaffected.
+	  */
+
+	  ez_ntp_tsc_rebase();
+	  continue;
+	}
+
+      if(tsc_point(&point) != 0 ||
+	 (frequency = tsc_frequency(&previous, &point)) <= 0.0)
+	break;
+
+      if(tsc_difference(current, frequency) > EZ_NTP_TSC_TOLERANCE)
+	break;
+
+      tsc_publish(&point, frequency);
+      current = frequency;
+      previous = point;
+    }
+
+  if(fd != -1)
+    close(fd);
+
+  __atomic_store_n(&tsc.active, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void tsc_publish(const struct tsc_point *point, double frequency)
+{
+  int64_t base_ns = point->realtime_ns;
+  int64_t gap = 0;
+  int64_t ns = 0;
+  uint32_t sequence = 0;
+  uint64_t limit = 0;
+  uint64_t now = 0;
+  uint64_t scale = 0;
+  uint64_t ticks = point->realtime_ticks;
+
+  /*
+  ** A zero frequency keeps the current scale and limit; the clock was
+  ** set and the base follows it at once.
+  */
+
+  pthread_mutex_lock(&tsc_mutex);
+
+  if(frequency > 0.0)
+    {
+      limit = (uint64_t) (frequency * 1000000000.0 * EZ_NTP_TSC_VALIDITY);
+      scale = (uint64_t) ((double) (1ULL << EZ_NTP_TSC_SHIFT) / frequency);
+
+      /*
+      ** Rebase at this moment on the current conversion and reach the
+      ** measured time one interval later.
+      */
+
+      now = __rdtsc();
+
+      if(tsc.scale > 0 && now >= ticks && now >= tsc.base_ticks &&
+	 now - tsc.base_ticks <= tsc.limit && now - ticks <= limit)
+	{
+	  ns = tsc.base_ns +
+	    (int64_t) (((now - tsc.base_ticks) * tsc.scale) >>
+		       EZ_NTP_TSC_SHIFT);
+	  gap = base_ns +
+	    (int64_t) (((now - ticks) * scale) >> EZ_NTP_TSC_SHIFT) - ns;
+
+	  if(gap >= -EZ_NTP_TSC_SLEW && gap <= EZ_NTP_TSC_SLEW)
+	    {
+	      base_ns = ns;
+	      scale = (uint64_t)
+		((double) scale *
+		 ((double) (EZ_NTP_TSC_INTERVAL * 1000000000LL + gap) /
+		  (double) (EZ_NTP_TSC_INTERVAL * 1000000000LL)));
+	      ticks = now;
+	    }
+	}
+    }
+  else
+    {
+      limit = tsc.limit;
+      scale = tsc.scale;
+    }
+
+  if(scale > 0 && limit > UINT64_MAX / scale)
+    limit = UINT64_MAX / scale;
+
+  if(scale > 0)
+    {
+      sequence = tsc.sequence;
+      __atomic_store_n(&tsc.sequence, sequence + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      __atomic_store_n(&tsc.base_ticks, ticks, __ATOMIC_RELAXED);
+      __atomic_store_n(&tsc.base_ns, base_ns, __ATOMIC_RELAXED);
+      __atomic_store_n(&tsc.limit, limit, __ATOMIC_RELAXED);
+      __atomic_store_n(&tsc.scale, scale, __ATOMIC_RELAXED);
+      __atomic_store_n(&tsc.sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+
+  pthread_mutex_unlock(&tsc_mutex);
+}
+
+static int tsc_wait(int fd)
+{
+#if defined(__linux__) && defined(TFD_TIMER_CANCEL_ON_SET)
+  struct itimerspec its;
+  uint64_t expirations = 0;
+
+  /*
+  ** Returns 1 if the clock was set during the interval. An absolute
+  ** CLOCK_REALTIME timer with TFD_TIMER_CANCEL_ON_SET is cancelled by
+  ** any step, whichever process makes it.
+  */
+
+  if(fd != -1)
+    {
+      memset(&its, 0, sizeof(its));
+
+      if(clock_gettime(CLOCK_REALTIME, &its.it_value) == 0)
+	{
+	  its.it_value.tv_sec += EZ_NTP_TSC_INTERVAL;
+
+	  if(timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			     &its, 0) == 0)
+	    for(;;)
+	      {
+		if(read(fd, &expirations, sizeof(expirations)) ==
+		   (ssize_t) sizeof(expirations))
+		  return 0;
+		else if(errno == ECANCELED)
+		  return 1;
+		else if(errno != EINTR)
+		  break;
+	      }
+	}
+    }
+#else
+  (void) fd;
+#endif
+
+  sleep(EZ_NTP_TSC_INTERVAL);
+  return 0;
+}
+#endif
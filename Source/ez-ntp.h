@@ -0,0 +1,152 @@
+/*
+** Copyright (c) 2005 - present, Alexis Megas.
+** All rights reserved.
+**
+** Redistribution and use in source and binary forms, with or without
+** modification, are permitted provided that the following conditions
+** are met:
+** 1. Redistributions of source code must retain the above copyright
+**    notice, this list of conditions and the following disclaimer.
+** 2. Redistributions in binary form must reproduce the above copyright
+**    notice, this list of conditions and the following disclaimer in the
+**    documentation and/or other materials provided with the distribution.
+** 3. The name of the author may not be used to endorse or promote products
+**    derived from this software without specific prior written permission.
+**
+** THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+** IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+** OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+** IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+** INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+** NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+** DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+** THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+** (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+** THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _ez_ntp_h_
+#define _ez_ntp_h_
+
+/*
+** libez-ntp, the protocol and sample math of ez-ntpc.
+**
+** A query is driven by the caller's own event loop:
+**
+**   ez_ntp_query_init(&q);
+**   ez_ntp_query_start(&q, &addr);
+**   while(q.state is neither EZ_NTP_STATE_FINISHED nor failed)
+**     poll() ez_ntp_query_fd(&q) for ez_ntp_query_events(&q), then
+**     ez_ntp_query_process(&q, revents);
+**
+** ez_ntp_query_wait() does the same for callers that may block.
+**
+** In multicast mode the server sends the same time string in UDP
+** datagrams. ez_ntp_multicast_receive() yields samples whose offset
+** excludes the one-way delay; callers calibrate the delay with an
+** occasional query.
+**
+** An interleaved server also reports, for the client's previous exchange,
+** the stamp it sent and the time the response actually left.
+** ez_ntp_sample_interleave() refines the previous sample accordingly.
+**
+** With fast_open set, a query carries EZ_NTP_REQUEST in its SYN if the
+** kernel holds a TCP Fast Open cookie for the server. The server may then
+** answer within the first round trip. Otherwise the query proceeds as a
+** plain connection and sends nothing. fast_opened records whether the
+** request went with the SYN. If such a query is reset, the server did not
+** expect the request and fast_open is cleared. Without MSG_FASTOPEN,
+** fast_open has no effect.
+**
+** Stamps are taken by ez_ntp_gettime(), which calls gettimeofday() unless
+** ez_ntp_tsc_start() has succeeded. The invariant TSC is then read and
+** converted to wall time with a calibration which a background thread
+** refreshes against CLOCK_MONOTONIC and CLOCK_REALTIME every second.
+** Stamps do not decrease across refreshes: small corrections are slewed
+** in over the following second. The TSC is abandoned if its frequency drifts, and a calibration older than
+** three seconds is not used. On Linux, the thread follows steps made by
+** any process at once; elsewhere, callers which step the clock call
+** ez_ntp_tsc_rebase().
+*/
+
+#include <netinet/in.h>
+#include <sys/time.h>
+
+#define EZ_NTP_AGAIN 1
+#define EZ_NTP_DONE 0
+#define EZ_NTP_ERROR -1
+#define EZ_NTP_MAX_STRATUM 16
+#define EZ_NTP_REQUEST "\r\n"
+#define EZ_NTP_STATE_CONNECTING 1
+#define EZ_NTP_STATE_FINISHED 3
+#define EZ_NTP_STATE_IDLE 0
+#define EZ_NTP_STATE_READING 2
+
+/*
+** The server's response:
+** seconds,microseconds[,stratum,error[,previous seconds,previous
+** microseconds,transmit seconds,transmit microseconds]]\r\n.
+** Plain servers omit the stratum and error; both are then zero. The
+** previous fields are zero if the server has no record of the client.
+**
+** ez_ntp_format() writes a response with 2, 4 or 8 fields and a
+** terminating NUL, returning its length or -1 if the buffer is too small.
+** ez_ntp_parse() accepts exactly these forms.
+*/
+
+struct ez_ntp_response
+{
+  int interleaved; /* The previous fields are present. */
+  int stratum;
+  long error; /* Microseconds. */
+  struct timeval previous_tp; /* The stamp of the previous response. */
+  struct timeval previous_transmit_tp; /* When it was sent. */
+  struct timeval server_tp;
+};
+
+struct ez_ntp_sample
+{
+  long delay;  /* Microseconds, receive_tp - transmit_tp. */
+  long offset; /* Microseconds, server minus local. */
+  struct ez_ntp_response response;
+  struct timeval receive_tp;  /* After the response was read. */
+  struct timeval transmit_tp; /* Before connect(). */
+};
+
+struct ez_ntp_query
+{
+  char buffer[2 * sizeof(long unsigned int) + 64];
+  int error; /* An errno value if a call returned EZ_NTP_ERROR. */
+  int fast_open;
+  int fast_opened; /* The request was sent with the SYN. */
+  int fd;
+  int shutdown_before_close;
+  int so_linger;
+  int state; /* The state in which the query finished or failed. */
+  size_t length;
+  struct ez_ntp_sample sample;
+};
+
+int ez_ntp_format(char *, size_t, const struct ez_ntp_response *, int);
+int ez_ntp_gettime(struct timeval *);
+int ez_ntp_multicast_open(const struct sockaddr_in *);
+int ez_ntp_multicast_receive(int, struct ez_ntp_sample *);
+int ez_ntp_parse(const char *, size_t, struct ez_ntp_response *);
+int ez_ntp_parse_address(const char *, struct sockaddr_in *);
+int ez_ntp_query_fd(const struct ez_ntp_query *);
+int ez_ntp_query_process(struct ez_ntp_query *, short);
+int ez_ntp_query_start(struct ez_ntp_query *, const struct sockaddr_in *);
+int ez_ntp_query_wait(struct ez_ntp_query *, int);
+int ez_ntp_sample_interleave(struct ez_ntp_sample *,
+			     const struct ez_ntp_sample *);
+int ez_ntp_tsc_active(void);
+int ez_ntp_tsc_start(void);
+long ez_ntp_timeval_to_usec(const struct timeval *);
+short ez_ntp_query_events(const struct ez_ntp_query *);
+void ez_ntp_query_cancel(struct ez_ntp_query *);
+void ez_ntp_query_init(struct ez_ntp_query *);
+void ez_ntp_sample_compute(struct ez_ntp_sample *);
+void ez_ntp_tsc_rebase(void);
+void ez_ntp_usec_to_timeval(long, struct timeval *);
+
+#endif
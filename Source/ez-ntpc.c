@@ -32,8 +32,13 @@
 #include <arpa/inet.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <math.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 
 /*
 ** -- Local Includes --
@@ -42,37 +47,207 @@
 #define PIDFILE "/var/run/ez-ntpc.pid"
 
 #include "ez-common.h"
+#include "ez-ntp-shm.h"
+#include "ez-ntp-trace.h"
+#include "ez-ntp.h"
 
-static void onalarm(int);
+/*
+** Multicast samples exclude the one-way delay. A unicast query
+** calibrates the delay initially and every EZ_MULTICAST_CALIBRATION
+** samples thereafter.
+*/
+
+#define EZ_MULTICAST_CALIBRATION 64
+#define EZ_MULTICAST_TIMEOUT 64000 /* Milliseconds. */
+
+/*
+** Frequency discipline. The clock's frequency error is estimated over
+** windows of EZ_FREQUENCY_WINDOW seconds from the measured offsets and
+** the corrections applied within the window. Every adjustment also
+** slews the clock by the expected drift of the following interval.
+** The estimate is saved in the drift file, a single value in parts per
+** million, hourly and on exit.
+*/
+
+#define EZ_DRIFT_INTERVAL 3600 /* Seconds. */
+#define EZ_FREQUENCY_WINDOW 256 /* Seconds. */
+#define EZ_MAX_FREQUENCY 500.0 /* Parts per million. */
+
+/*
+** Holdover. While the server is unavailable, the clock is slewed by the
+** expected drift at the learned frequency and the error bound grows at
+** EZ_NTP_SHM_PHI. The client reports itself synchronized until the
+** holdover limit expires. Afterwards, corrections are slewed at no more
+** than EZ_RECOVERY_RATE until the offset has been absorbed.
+*/
+
+#define EZ_MAX_HOLDOVER 604800 /* Seconds. */
+#define EZ_RECOVERY_RATE 500.0 /* Parts per million. */
+
+/*
+** One-shot synchronization. Up to once_burst exchanges are made back to
+** back within the deadline. The sample with the smallest delay is
+** selected; its error bound is half the delay plus the server's error
+** plus the RMS deviation of the better half of the samples from it. The
+** clock is stepped or slewed according to the policy, regardless of the
+** daemon's limits, and the exit status reports whether the error bound
+** met once_max_error.
+*/
+
+#define EZ_ONCE_BACKOFF 100 /* Milliseconds. */
+#define EZ_ONCE_INACCURATE 2 /* Exit status. */
+#define EZ_ONCE_MAX_BURST 64
+#define EZ_ONCE_MAX_DEADLINE 600000 /* Milliseconds. */
+#define EZ_ONCE_MAX_ERROR 1000000000L /* Microseconds. */
+#define EZ_ONCE_POLICY_AUTO 0
+#define EZ_ONCE_POLICY_SLEW 1
+#define EZ_ONCE_POLICY_STEP 2
+
+/*
+** Metrics. Counters and histograms are kept in memory and exported, in
+** the Prometheus text format, by atomically replacing the metrics file
+** between exchanges. Histogram bounds are in microseconds; the last
+** bucket is unbounded.
+*/
+
+#define EZ_METRICS_BUCKETS 7
+
+struct metrics_histogram
+{
+  double sum; /* Microseconds. */
+  unsigned long buckets[EZ_METRICS_BUCKETS];
+  unsigned long count;
+};
+
+struct metrics
+{
+  double jitter; /* Microseconds, an exponential RMS average. */
+  int changed;
+  long last_delay;
+  long last_offset;
+  struct metrics_histogram delay;
+  struct metrics_histogram jitters;
+  struct metrics_histogram offsets;
+  struct timeval last_tp;
+  long error; /* Microseconds. */
+  unsigned long errors_connect;
+  unsigned long errors_recv;
+  unsigned long holdovers;
+  unsigned long none;
+  unsigned long parse_failures;
+  unsigned long rejected;
+  unsigned long samples;
+  unsigned long slews;
+  unsigned long steps;
+  unsigned long timeouts_connect;
+  unsigned long timeouts_recv;
+  unsigned long unsynchronized;
+};
+
+static const long metrics_bounds[EZ_METRICS_BUCKETS - 1] =
+  {10, 100, 1000, 10000, 100000, 1000000};
+
+static char drift_path[PATH_MAX];
+static char metrics_path[PATH_MAX];
+static double frequency = 0.0;
+static int fast_open = 0;
+static int frequency_valid = 0;
+static int holdover = 0;
+static int once = 0;
+static int once_policy = EZ_ONCE_POLICY_AUTO;
+static int recovering = 0;
+static int tsc = 0;
+static int window_valid = 0;
+static long applied = 0;
+static long corrections = 0;
+static long once_burst = 8;
+static long once_deadline = 10000; /* Milliseconds. */
+static long once_max_error = 100000; /* Microseconds. */
+static long once_step_threshold = 128000; /* Microseconds. */
+static long holdover_limit = 0; /* Seconds. */
+static long sync_error = 0;
+static long trace_records = 65536;
+static long window_offset = 0;
+static struct ez_ntp_shm *shm = 0;
+static struct ez_ntp_trace *trace = 0;
+static struct metrics metrics;
+static struct sockaddr_in trace_peer;
+static struct timeval adjust_tp;
+static struct timeval drift_tp;
+static struct timeval sync_tp;
+static struct timeval window_tp;
+static int drift_read(void);
+static int shm_init(const char *);
+static int once_compare(const void *, const void *);
+static int once_sync(struct ez_ntp_query *, const struct sockaddr_in *);
+static int metrics_append(char *, size_t, size_t *, const char *, ...)
+  __attribute__((format(printf, 4, 5)));
+static int metrics_append_histogram(char *, size_t, size_t *, const char *,
+				    const char *,
+				    const struct metrics_histogram *);
+static int slew_clock(long);
+static long applied_total(void);
+static int once_wait(struct ez_ntp_query *, const struct timespec *);
+static long once_remaining(const struct timespec *);
+static void adjust_clock(long, long, const struct ez_ntp_sample *);
+static void drift_write(void);
+static void holdover_apply(void);
+static void metrics_failure(const struct ez_ntp_query *);
+static void metrics_observe(struct metrics_histogram *, long);
+static void metrics_write(void);
+static void shm_publish(int, long, long, const struct timeval *);
+static void trace_failure(const struct ez_ntp_query *);
+static void trace_sample(int, const struct ez_ntp_sample *, long, long);
+static void update_frequency(long, const struct timeval *);
 
 int main(int argc, char *argv[])
 {
-  char buffer[2 * sizeof(long unsigned int) + 64];
   char *endptr;
-  char rd_buffer[16];
   char remote_host[128];
-  char *tmp = 0;
+  char shm_path[PATH_MAX];
+  char trace_path[PATH_MAX];
+  int calibrated = 0;
   int err = 0;
-  int goodtime = 0;
+  int held = 0;
   int i = 0;
+  int multicast_fd = -1;
   int n = 0;
-  int timeofday_after_recv = 0;
-  int timeofday_before_connect = 0;
+  int rc = 0;
+  long calibration_error = 0;
+  long held_applied = 0;
+  long now_applied = 0;
+  long one_way_delay = 0;
+  long samples = 0;
   long port_num = -1;
-  ssize_t rc = 0;
+  struct ez_ntp_query query;
+  struct ez_ntp_sample held_sample;
+  struct ez_ntp_sample sample;
+  struct pollfd pfd;
   struct stat st;
-  struct timeval after_recv_tp;
-  struct timeval before_connect_tp;
-  struct timeval home_tp;
-  struct timeval delta_tp;
-  struct timeval server_tp;
-  struct timeval temp_tp;
-  struct sigaction act;
+  struct sockaddr_in multicast_addr;
   struct sockaddr_in servaddr;
 
   for(i = 0; i < argc; i++)
     if(argv && argv[i] && strcmp(argv[i], "--disable-all-logs") == 0)
       disable_all_logs = 1;
+    else if(argv && argv[i] && strcmp(argv[i], "--foreground") == 0)
+      foreground = 1;
+    else if(argv && argv[i] && strcmp(argv[i], "--once") == 0)
+      once = 1;
+    else if(argv && argv[i] && strcmp(argv[i], "--pidfile") == 0)
+      {
+	if(i + 1 < argc && argv[i + 1])
+	  n = snprintf(pidfile, sizeof(pidfile), "%s", argv[i + 1]);
+	else
+	  n = -1;
+
+	if(!(n >= 0 && n < (int) sizeof(pidfile)) ||
+	   (n > 0 && pidfile[0] != '/'))
+	  {
+	    fprintf(stderr, "%s", "Invalid pidfile, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
     else if(argv && argv[i] && strcmp(argv[i], "--shutdown-before-close") == 0)
       shutdown_before_close = 1;
 
@@ -82,16 +257,32 @@ int main(int argc, char *argv[])
       setlogmask(LOG_UPTO(LOG_INFO));
     }
 
-  if(stat(PIDFILE, &st) == 0)
+  /*
+  ** A one-shot synchronization may precede the daemon. It neither
+  ** detaches nor claims the process identifier file.
+  */
+
+  if(once)
+    {
+      foreground = 1;
+      memset(pidfile, 0, sizeof(pidfile));
+    }
+
+  if(strlen(pidfile) > 0 && stat(pidfile, &st) == 0)
     {
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "%s already exists, exiting", PIDFILE);
+	syslog(LOG_ERR, "%s already exists, exiting", pidfile);
 
-      fprintf(stderr, "%s already exists, exiting.\n", PIDFILE);
+      fprintf(stderr, "%s already exists, exiting.\n", pidfile);
       return EXIT_FAILURE;
     }
 
   memset(remote_host, 0, sizeof(remote_host));
+  memset(drift_path, 0, sizeof(drift_path));
+  memset(&metrics, 0, sizeof(metrics));
+  memset(metrics_path, 0, sizeof(metrics_path));
+  memset(shm_path, 0, sizeof(shm_path));
+  memset(trace_path, 0, sizeof(trace_path));
 
   for(; *argv != 0; argv++)
     if(strcmp(*argv, "--host") == 0)
@@ -155,6 +346,257 @@ int main(int argc, char *argv[])
 	      so_linger = -1;
 	  }
       }
+    else if(strcmp(*argv, "--drift-file") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    n = snprintf(drift_path, sizeof(drift_path), "%s", *argv);
+
+	    if(!(n > 0 && n < (int) sizeof(drift_path) - 8))
+	      memset(drift_path, 0, sizeof(drift_path));
+	  }
+
+	if(drift_path[0] != '/')
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid drift file, exiting");
+
+	    fprintf(stderr, "%s", "Invalid drift file, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--burst") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    once_burst = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || once_burst < 1 ||
+	   once_burst > EZ_ONCE_MAX_BURST)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid burst, exiting");
+
+	    fprintf(stderr, "%s", "Invalid burst, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--deadline") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    once_deadline = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || once_deadline < 1 ||
+	   once_deadline > EZ_ONCE_MAX_DEADLINE)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid deadline, exiting");
+
+	    fprintf(stderr, "%s", "Invalid deadline, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--fast-open") == 0)
+      fast_open = 1;
+    else if(strcmp(*argv, "--holdover") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    holdover_limit = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || holdover_limit < 1 ||
+	   holdover_limit > EZ_MAX_HOLDOVER)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid holdover, exiting");
+
+	    fprintf(stderr, "%s", "Invalid holdover, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--max-error") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    once_max_error = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || once_max_error < 0 ||
+	   once_max_error > EZ_ONCE_MAX_ERROR)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid maximum error, exiting");
+
+	    fprintf(stderr, "%s", "Invalid maximum error, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--metrics-file") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    n = snprintf(metrics_path, sizeof(metrics_path), "%s", *argv);
+
+	    if(!(n > 0 && n < (int) sizeof(metrics_path) - 8))
+	      memset(metrics_path, 0, sizeof(metrics_path));
+	  }
+
+	if(metrics_path[0] != '/')
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid metrics file, exiting");
+
+	    fprintf(stderr, "%s", "Invalid metrics file, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--multicast") == 0)
+      {
+	argv++;
+
+	if(*argv == 0 ||
+	   ez_ntp_parse_address(*argv, &multicast_addr) != 0 ||
+	   !IN_MULTICAST(ntohl(multicast_addr.sin_addr.s_addr)))
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid multicast group, exiting");
+
+	    fprintf(stderr, "%s", "Invalid multicast group, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+
+	multicast_fd = 0;
+      }
+    else if(strcmp(*argv, "--policy") == 0)
+      {
+	argv++;
+
+	if(*argv != 0 && strcmp(*argv, "auto") == 0)
+	  once_policy = EZ_ONCE_POLICY_AUTO;
+	else if(*argv != 0 && strcmp(*argv, "slew") == 0)
+	  once_policy = EZ_ONCE_POLICY_SLEW;
+	else if(*argv != 0 && strcmp(*argv, "step") == 0)
+	  once_policy = EZ_ONCE_POLICY_STEP;
+	else
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid policy, exiting");
+
+	    fprintf(stderr, "%s", "Invalid policy, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--shm") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    n = snprintf(shm_path, sizeof(shm_path), "%s", *argv);
+
+	    if(!(n > 0 && n < (int) sizeof(shm_path)))
+	      memset(shm_path, 0, sizeof(shm_path));
+	  }
+
+	if(shm_path[0] != '/')
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid shm path, exiting");
+
+	    fprintf(stderr, "%s", "Invalid shm path, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--step-threshold") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    once_step_threshold = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || once_step_threshold < 0 ||
+	   once_step_threshold > EZ_ONCE_MAX_ERROR)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid step threshold, exiting");
+
+	    fprintf(stderr, "%s", "Invalid step threshold, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--tsc") == 0)
+      tsc = 1;
+    else if(strcmp(*argv, "--trace") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    n = snprintf(trace_path, sizeof(trace_path), "%s", *argv);
+
+	    if(!(n > 0 && n < (int) sizeof(trace_path)))
+	      memset(trace_path, 0, sizeof(trace_path));
+	  }
+
+	if(trace_path[0] != '/')
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid trace path, exiting");
+
+	    fprintf(stderr, "%s", "Invalid trace path, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--trace-records") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    trace_records = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || trace_records < EZ_NTP_TRACE_MIN_RECORDS ||
+	   trace_records > EZ_NTP_TRACE_MAX_RECORDS ||
+	   (trace_records & (trace_records - 1)) != 0)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid trace records, exiting");
+
+	    fprintf(stderr, "%s", "Invalid trace records, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
 
   if(port_num <= 0 || port_num > 65535 || strlen(remote_host) == 0)
     {
@@ -187,24 +629,61 @@ int main(int argc, char *argv[])
 
   preconnect_init();
 
-  /*
-  ** Establish handlers for SIGALRM.
-  */
-
-  act.sa_handler = onalarm;
-  sigemptyset(&act.sa_mask);
-  act.sa_flags = 0;
-
-  if(sigaction(SIGALRM, &act, 0) != 0)
+  if(tsc)
     {
-      err = errno;
+      if(ez_ntp_tsc_start() == 0)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_INFO, "%s", "timestamps are read from the TSC");
+	}
+      else if(disable_all_logs == 0)
+	syslog(LOG_ERR, "the TSC is unavailable, %s, using gettimeofday()",
+	       strerror(errno));
+    }
 
-      if(disable_all_logs == 0)
-	syslog(LOG_ERR, "sigaction() failed, %s", strerror(err));
+  if(strlen(drift_path) > 0)
+    {
+      if(drift_read() == 0)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_INFO, "frequency %.3f ppm read from %s", frequency,
+		   drift_path);
+	}
+      else if(errno != ENOENT && disable_all_logs == 0)
+	syslog(LOG_ERR, "unable to read %s", drift_path);
 
-      fprintf(stderr, "sigaction() failed, %s.\n", strerror(err));
+      onexit_function = drift_write;
     }
 
+  if(strlen(shm_path) > 0)
+    if(shm_init(shm_path) != 0)
+      {
+	err = errno;
+
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "unable to map %s, %s, exiting", shm_path,
+		 strerror(err));
+
+	fprintf(stderr, "Unable to map %s, %s, exiting.\n", shm_path,
+		strerror(err));
+	return EXIT_FAILURE;
+      }
+
+  if(strlen(trace_path) > 0)
+    if((trace = ez_ntp_trace_create(trace_path,
+				    (uint32_t) trace_records)) == 0)
+      {
+	err = errno;
+
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "unable to map %s, %s, exiting", trace_path,
+		 strerror(err));
+
+	fprintf(stderr, "Unable to map %s, %s, exiting.\n", trace_path,
+		strerror(err));
+	return EXIT_FAILURE;
+      }
+
   /*
   ** Establish a connection to the remote host.
   */
@@ -213,231 +692,1088 @@ int main(int argc, char *argv[])
   servaddr.sin_addr.s_addr = inet_addr(remote_host);
   servaddr.sin_family = AF_INET;
   servaddr.sin_port = htons((uint16_t) port_num);
+  trace_peer = servaddr;
+  ez_ntp_query_init(&query);
+  query.fast_open = fast_open;
+  query.shutdown_before_close = shutdown_before_close;
+  query.so_linger = so_linger;
 
-  while(terminated < 1)
-    {
-      while((sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
-	{
-	  if(disable_all_logs == 0)
-	    syslog(LOG_ERR, "socket() failed, %s, "
-		   "trying again in 5 seconds", strerror(errno));
+  if(once)
+    return once_sync(&query, &servaddr);
 
-	  sleep(5);
-	}
+  if(multicast_fd == 0)
+    if((multicast_fd = ez_ntp_multicast_open(&multicast_addr)) == -1)
+      {
+	err = errno;
 
-      alarm(8);
-      timeofday_after_recv = 0;
-      timeofday_before_connect = 0;
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "unable to join the multicast group, %s, exiting",
+		 strerror(err));
 
-      if(gettimeofday(&before_connect_tp, 0) == 0)
-	timeofday_before_connect = 1;
+	fprintf(stderr, "Unable to join the multicast group, %s, exiting.\n",
+		strerror(err));
+	return EXIT_FAILURE;
+      }
 
-      if(connect(sock_fd, (const struct sockaddr *) &servaddr,
-		 sizeof(servaddr)) == -1)
-	{
-	  alarm(0);
+  ez_notify("READY=1");
 
+  while(terminated < 1 && multicast_fd > -1)
+    {
+      metrics_write();
+      pfd.events = POLLIN;
+      pfd.fd = multicast_fd;
+      pfd.revents = 0;
+
+      if((rc = poll(&pfd, 1, EZ_MULTICAST_TIMEOUT)) == -1 && errno == EINTR)
+	continue;
+      else if(rc <= 0)
+	{
 	  if(disable_all_logs == 0)
-	    syslog(LOG_ERR, "connect() failed, %s, "
-		   "trying again in 5 seconds", strerror(errno));
+	    syslog(LOG_ERR, "%s", "multicast time unavailable");
 
-	  close(sock_fd);
-	  sock_fd = -1;
-	  sleep(5);
+	  holdover_apply();
 	  continue;
 	}
-      else
-	alarm(0);
-
-      if(terminated > 0)
-	break;
 
-      memset(buffer, 0, sizeof(buffer));
+      if(ez_ntp_multicast_receive(multicast_fd, &sample) != EZ_NTP_DONE)
+	continue;
 
-      for(goodtime = 0;;)
+      if(sample.response.stratum >= EZ_NTP_MAX_STRATUM)
 	{
-	  if(strnlen(buffer, sizeof(buffer)) > 2 &&
-	     strstr(buffer, "\r\n") != 0)
-	    break;
-
-	  alarm(8);
-	  memset(rd_buffer, 0, sizeof(rd_buffer));
+	  metrics.changed = 1;
+	  metrics.unsynchronized += 1;
+	  trace_sample(EZ_NTP_TRACE_UNSYNCHRONIZED, &sample, sample.offset, 0);
+	  holdover_apply();
+	  continue;
+	}
 
-	  if((rc = recv(sock_fd, rd_buffer, sizeof(rd_buffer) - 1,
-			MSG_PEEK)) > 0)
+      if(calibrated == 0 || ++samples >= EZ_MULTICAST_CALIBRATION)
+	{
+	  if(ez_ntp_query_start(&query, &servaddr) == EZ_NTP_ERROR ||
+	     ez_ntp_query_wait(&query, 8000) == EZ_NTP_ERROR ||
+	     query.sample.response.stratum >= EZ_NTP_MAX_STRATUM)
 	    {
-	      alarm(0);
+	      if(query.state != EZ_NTP_STATE_FINISHED)
+		{
+		  metrics_failure(&query);
+		  trace_failure(&query);
+		}
+	      else
+		trace_sample(EZ_NTP_TRACE_UNSYNCHRONIZED, &query.sample,
+			     query.sample.offset, 0);
 
-	      if((size_t) rc > sizeof(rd_buffer) - 1)
-		rc = sizeof(rd_buffer) - 1;
+	      if(disable_all_logs == 0)
+		syslog(LOG_ERR, "%s", "unable to calibrate the one-way delay");
 
-	      memset(rd_buffer, 0, sizeof(rd_buffer));
-	      alarm(8);
-	      rc = recv(sock_fd, rd_buffer, (size_t) rc, MSG_WAITALL);
-	      alarm(0);
+	      if(calibrated == 0)
+		continue;
 	    }
 	  else
-	    alarm(0);
-
-	  if(rc > 0)
 	    {
-	      if(sizeof(buffer) > strnlen(buffer, sizeof(buffer)))
-		strncat
-		  (buffer, rd_buffer,
-		   sizeof(buffer) - strnlen(buffer,
-					    sizeof(buffer) - 1) - 1);
-	      else
-		break;
+	      calibrated = 1;
+	      calibration_error = query.sample.delay / 2;
+	      metrics_observe(&metrics.delay, query.sample.delay);
+	      one_way_delay = query.sample.offset - sample.offset;
+	      samples = 0;
+	      adjust_clock(query.sample.offset, calibration_error,
+			   &query.sample);
+	      continue;
 	    }
-	  else
-	    break;
-
-	  if(strnlen(buffer, sizeof(buffer)) >
-	     2 * sizeof(long unsigned int) + 16)
-	    break;
 	}
 
-      if(strnlen(buffer, sizeof(buffer)) > 2 && strstr(buffer, "\r\n") != 0)
-	{
-	  goodtime = 1;
+      adjust_clock(sample.offset + one_way_delay, calibration_error,
+		   &sample);
+    }
 
-	  if(gettimeofday(&after_recv_tp, 0) == 0)
-	    timeofday_after_recv = 1;
-	}
+  while(terminated < 1)
+    {
+      metrics_write();
 
-      if(goodtime == 0)
+      if(ez_ntp_query_start(&query, &servaddr) == EZ_NTP_ERROR ||
+	 ez_ntp_query_wait(&query, 8000) == EZ_NTP_ERROR)
 	{
-	  ez_close(sock_fd);
-	  sock_fd = -1;
-
-	  if(disable_all_logs == 0)
-	    syslog(LOG_ERR, "incorrect time (%s)", buffer);
+	  held = 0;
+	  metrics_failure(&query);
+	  trace_failure(&query);
 
-	  sleep(1);
-	  continue;
-	}
+	  if(query.state == EZ_NTP_STATE_CONNECTING)
+	    {
+	      if(disable_all_logs == 0)
+		syslog(LOG_ERR, "connect() failed, %s, "
+		       "trying again in 5 seconds", strerror(query.error));
 
-      tmp = strtok(buffer, ",");
-
-      if(tmp != 0)
-	{
-	  server_tp.tv_sec = strtol(tmp, &endptr, 10);
-
-	  if(errno == EINVAL || errno == ERANGE)
-	    {
-	      ez_close(sock_fd);
-	      sock_fd = -1;
-	      sleep(1);
-	      continue;
+	      holdover_apply();
+	      sleep(5);
 	    }
-	  else if(endptr == tmp)
+	  else
 	    {
-	      ez_close(sock_fd);
-	      sock_fd = -1;
+	      if(disable_all_logs == 0)
+		syslog(LOG_ERR, "incorrect time (%s)", query.buffer);
+
+	      holdover_apply();
 	      sleep(1);
-	      continue;
 	    }
+
+	  continue;
 	}
-      else
+
+      if(terminated > 0)
+	break;
+
+      /*
+      ** Relays report their stratum.
+      */
+
+      if(query.sample.response.stratum >= EZ_NTP_MAX_STRATUM)
 	{
-	  ez_close(sock_fd);
-	  sock_fd = -1;
+	  if(disable_all_logs == 0)
+	    syslog(LOG_INFO, "%s", "server is not synchronized");
+
+	  held = 0;
+	  metrics.changed = 1;
+	  metrics.unsynchronized += 1;
+	  trace_sample(EZ_NTP_TRACE_UNSYNCHRONIZED, &query.sample,
+		       query.sample.offset, 0);
+	  holdover_apply();
 	  sleep(1);
 	  continue;
 	}
 
-      tmp = strtok(0, "\r\n");
+      metrics_observe(&metrics.delay, query.sample.delay);
+      metrics.last_delay = query.sample.delay;
 
-      if(tmp != 0)
+      if(query.sample.response.interleaved)
+	{
+	  /*
+	  ** An interleaved server reports when its previous response
+	  ** actually left. The refined previous sample is carried forward
+	  ** by the corrections applied since it was taken. If the server
+	  ** has no record of the previous exchange, the current sample is
+	  ** used as it stands.
+	  */
+
+	  now_applied = applied_total();
+
+	  if(held &&
+	     ez_ntp_sample_interleave(&held_sample, &query.sample) ==
+	     EZ_NTP_DONE)
+	    adjust_clock(held_sample.offset - (now_applied - held_applied),
+			 held_sample.delay / 2, &held_sample);
+	  else
+	    adjust_clock(query.sample.offset, query.sample.delay / 2,
+			 &query.sample);
+
+	  held = 1;
+	  held_applied = now_applied;
+	  held_sample = query.sample;
+	}
+      else
 	{
-#if defined(__APPLE__)
-	  server_tp.tv_usec = atoi(tmp);
-#else
-	  server_tp.tv_usec = strtol(tmp, &endptr, 10);
-#endif
+	  held = 0;
+	  adjust_clock(query.sample.offset, query.sample.delay / 2,
+		       &query.sample);
+	}
+
+      sleep(1);
+    }
+
+  return EXIT_SUCCESS;
+}
+
+static void adjust_clock(long offset, long error,
+			 const struct ez_ntp_sample *sample)
+{
+  int action = EZ_NTP_TRACE_NONE;
+  long correction = offset;
+  long drift = 0;
+  long interval = 1000000L;
+  long limit = 0;
+  long value = 0;
+  struct timeval delta_tp;
+  struct timeval home_tp;
+  struct timeval server_tp;
+
+  if(ez_ntp_gettime(&home_tp) != 0)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "gettimeofday() failed, %s", strerror(errno));
+
+      return;
+    }
+
+  update_frequency(offset, &home_tp);
+
+  if(metrics.samples > 0)
+    {
+      metrics_observe(&metrics.jitters, offset - metrics.last_offset);
+      metrics.jitter += ((double) (offset - metrics.last_offset) *
+			 (double) (offset - metrics.last_offset) -
+			 metrics.jitter) / 4.0;
+    }
+
+  metrics_observe(&metrics.offsets, offset);
+  metrics.error = error;
+  metrics.last_offset = offset;
+  metrics.last_tp = home_tp;
+  metrics.samples += 1;
+  sync_error = error;
+  sync_tp = home_tp;
 
-	  if(errno == EINVAL || errno == ERANGE)
+  if(holdover)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_INFO, "leaving holdover, offset %ld usec", offset);
+
+      holdover = 0;
+      recovering = 1;
+    }
+
+  /*
+  ** The expected drift until the next adjustment.
+  */
+
+  if(adjust_tp.tv_sec > 0)
+    {
+      timersub(&home_tp, &adjust_tp, &delta_tp);
+      interval = ez_ntp_timeval_to_usec(&delta_tp);
+
+      if(interval < 1000000L)
+	interval = 1000000L;
+      else if(interval > 64000000L)
+	interval = 64000000L;
+    }
+
+  adjust_tp = home_tp;
+
+  if(frequency_valid)
+    drift = (long) (frequency * (double) interval / 1000000.0);
+
+  if(recovering)
+    {
+      /*
+      ** Absorb the error accumulated in holdover gradually.
+      */
+
+      limit = (long) ((double) interval * EZ_RECOVERY_RATE / 1000000.0);
+
+      if(labs(offset) <= limit)
+	recovering = 0;
+      else if(labs(offset) < 16000000L)
+	correction = offset > 0 ? limit : -limit;
+    }
+
+  ez_ntp_usec_to_timeval(correction, &delta_tp);
+
+  if(labs(correction) >= 1000000L)
+    {
+      if(labs(correction) < 16000000L)
+	{
+	  timeradd(&home_tp, &delta_tp, &server_tp);
+
+	  if(settimeofday(&server_tp, 0) != 0)
 	    {
-	      ez_close(sock_fd);
-	      sock_fd = -1;
-	      sleep(1);
-	      continue;
+	      action = EZ_NTP_TRACE_FAILED;
+	      value = errno;
+
+	      if(disable_all_logs == 0)
+		syslog(LOG_ERR, "settimeofday() failed, %s",
+		       strerror(errno));
+
+	      shm_publish(EZ_NTP_SHM_SYNCHRONIZED, offset, error, &home_tp);
 	    }
-	  else if(endptr == tmp)
+	  else
 	    {
-	      ez_close(sock_fd);
-	      sock_fd = -1;
-	      sleep(1);
-	      continue;
+	      if(disable_all_logs == 0)
+		syslog(LOG_INFO, "%s",
+		       "adjusted system time (settimeofday())");
+
+	      action = EZ_NTP_TRACE_STEP;
+	      value = correction;
+	      adjust_tp = server_tp;
+	      ez_ntp_tsc_rebase();
+	      applied += correction;
+	      metrics.steps += 1;
+	      window_valid = 0;
+	      slew_clock(drift);
+	      shm_publish(EZ_NTP_SHM_SYNCHRONIZED, 0, error, &server_tp);
 	    }
 	}
       else
 	{
-	  ez_close(sock_fd);
-	  sock_fd = -1;
-	  sleep(1);
+	  if(disable_all_logs == 0)
+	    syslog(LOG_INFO, "%s", "time beyond acceptable limits");
+
+	  action = EZ_NTP_TRACE_REJECTED;
+	  metrics.rejected += 1;
+	  shm_publish(EZ_NTP_SHM_SYNCHRONIZED, offset, error, &home_tp);
+	}
+    }
+  else if(labs(correction + drift) >= 5)
+    {
+      if(slew_clock(correction + drift) != 0)
+	{
+	  action = EZ_NTP_TRACE_FAILED;
+	  value = errno;
+
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "adjtime() failed, %s", strerror(errno));
+
+	  shm_publish(EZ_NTP_SHM_SYNCHRONIZED, offset, error, &home_tp);
+	}
+      else
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_INFO, "%s", "adjusted system time (adjtime())");
+
+	  action = EZ_NTP_TRACE_SLEW;
+	  metrics.slews += 1;
+	  value = correction + drift;
+
+	  /*
+	  ** The clock is slewing towards the server. Until the
+	  ** adjustment completes, the offset is part of the error.
+	  */
+
+	  shm_publish
+	    (EZ_NTP_SHM_SYNCHRONIZED, 0, error + labs(offset), &home_tp);
+	}
+    }
+  else
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_INFO, "%s", "time beyond acceptable limits");
+
+      metrics.none += 1;
+      shm_publish(EZ_NTP_SHM_SYNCHRONIZED, offset, error, &home_tp);
+    }
+
+  trace_sample(action, sample, offset, value);
+}
+
+static int once_compare(const void *a, const void *b)
+{
+  const struct ez_ntp_sample *x = a;
+  const struct ez_ntp_sample *y = b;
+
+  return x->delay < y->delay ? -1 : x->delay > y->delay ? 1 : 0;
+}
+
+static int once_sync(struct ez_ntp_query *query,
+		     const struct sockaddr_in *servaddr)
+{
+  const char *method = "unchanged";
+  double jitter = 0.0;
+  int action = EZ_NTP_TRACE_NONE;
+  int count = 0;
+  int exchanges = 0;
+  int i = 0;
+  int status = EXIT_SUCCESS;
+  long error = 0;
+  long offset = 0;
+  long remaining = 0;
+  long value = 0;
+  struct ez_ntp_sample samples[EZ_ONCE_MAX_BURST];
+  struct timespec start_tp;
+  struct timeval delta_tp;
+  struct timeval home_tp;
+  struct timeval server_tp;
+
+  clock_gettime(CLOCK_MONOTONIC, &start_tp);
+
+  while(count < once_burst && terminated < 1 &&
+	(remaining = once_remaining(&start_tp)) > 0)
+    {
+      exchanges += 1;
+
+      if(ez_ntp_query_start(query, servaddr) == EZ_NTP_ERROR ||
+	 once_wait(query, &start_tp) == EZ_NTP_ERROR)
+	{
+	  metrics_failure(query);
+	  trace_failure(query);
+	}
+      else if(query->sample.response.stratum >= EZ_NTP_MAX_STRATUM)
+	{
+	  metrics.unsynchronized += 1;
+	  trace_sample(EZ_NTP_TRACE_UNSYNCHRONIZED, &query->sample,
+		       query->sample.offset, 0);
+	}
+      else
+	{
+	  metrics_observe(&metrics.delay, query->sample.delay);
+	  samples[count++] = query->sample;
 	  continue;
 	}
 
-      if(gettimeofday(&home_tp, 0) == 0)
+      /*
+      ** The network or the server may not be ready yet.
+      */
+
+      if((remaining = once_remaining(&start_tp)) > 0)
+	poll(0, 0, (int) (remaining < EZ_ONCE_BACKOFF ?
+			  remaining : EZ_ONCE_BACKOFF));
+    }
+
+  metrics.changed = 1;
+
+  if(count == 0)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "no usable response in %d exchanges within %ld ms",
+	       exchanges, once_deadline);
+
+      fprintf(stderr, "No usable response in %d exchanges within %ld ms.\n",
+	      exchanges, once_deadline);
+      metrics_write();
+      return EXIT_FAILURE;
+    }
+
+  /*
+  ** Queuing only adds delay, and asymmetrically so. The least delayed
+  ** sample is the most accurate; the better half estimates the jitter.
+  */
+
+  qsort(samples, (size_t) count, sizeof(samples[0]), once_compare);
+  offset = samples[0].offset;
+
+  for(i = 1; i < (count + 1) / 2; i++)
+    jitter += (double) (samples[i].offset - offset) *
+      (double) (samples[i].offset - offset);
+
+  if(count > 2)
+    jitter = sqrt(jitter / (double) ((count + 1) / 2 - 1));
+
+  error = samples[0].delay / 2 + samples[0].response.error + (long) jitter;
+  ez_ntp_gettime(&home_tp);
+
+  if(offset == 0)
+    metrics.none += 1;
+  else if(once_policy == EZ_ONCE_POLICY_STEP ||
+	  (once_policy == EZ_ONCE_POLICY_AUTO &&
+	   labs(offset) >= once_step_threshold))
+    {
+      ez_ntp_usec_to_timeval(offset, &delta_tp);
+      timeradd(&home_tp, &delta_tp, &server_tp);
+
+      if(settimeofday(&server_tp, 0) != 0)
 	{
-	  if(timeofday_after_recv == 1 && timeofday_before_connect == 1)
-	    {
-	      /*
-	      ** Let's consider the trip time.
-	      */
-
-	      timersub(&after_recv_tp, &before_connect_tp, &temp_tp);
-	      temp_tp.tv_sec = temp_tp.tv_sec / 2;
-	      temp_tp.tv_usec = temp_tp.tv_usec / 2;
-	      timeradd(&server_tp, &temp_tp, &server_tp);
-	    }
+	  action = EZ_NTP_TRACE_FAILED;
+	  method = "settimeofday() failed";
+	  value = errno;
+	}
+      else
+	{
+	  action = EZ_NTP_TRACE_STEP;
+	  ez_ntp_tsc_rebase();
+	  home_tp = server_tp;
+	  method = "stepped";
+	  metrics.steps += 1;
+	  value = offset;
+	}
+    }
+  else if(slew_clock(offset) != 0)
+    {
+      action = EZ_NTP_TRACE_FAILED;
+      method = "adjtime() failed";
+      value = errno;
+    }
+  else
+    {
+      /*
+      ** Until the slew completes, the offset is part of the error.
+      */
+
+      action = EZ_NTP_TRACE_SLEW;
+      error += labs(offset);
+      method = "slewed";
+      metrics.slews += 1;
+      value = offset;
+    }
 
-	  if(labs(home_tp.tv_sec - server_tp.tv_sec) >= 1)
-	    {
-	      if(labs(home_tp.tv_sec - server_tp.tv_sec) <= 15)
-		{
-		  if(settimeofday(&server_tp, 0) != 0)
-		    {
-		      if(disable_all_logs == 0)
-			syslog(LOG_ERR, "settimeofday() failed, %s",
-			       strerror(errno));
-		    }
-		  else if(disable_all_logs == 0)
-		    syslog(LOG_INFO, "%s",
-			   "adjusted system time (settimeofday())");
-		}
-	      else if(disable_all_logs == 0)
-		syslog(LOG_INFO, "%s", "time beyond acceptable limits");
-	    }
-	  else if(labs(home_tp.tv_usec - server_tp.tv_usec) >= 5)
-	    {
-	      timersub(&server_tp, &home_tp, &delta_tp);
+  trace_sample(action, &samples[0], offset, value);
 
-	      if(adjtime(&delta_tp, 0) != 0)
-		{
-		  if(disable_all_logs == 0)
-		    syslog(LOG_ERR, "adjtime() failed, %s",
-			   strerror(errno));
-		}
-	      else if(disable_all_logs == 0)
-		syslog(LOG_INFO, "%s", "adjusted system time (adjtime())");
-	    }
-	  else if(disable_all_logs == 0)
-	    syslog(LOG_INFO, "%s", "time beyond acceptable limits");
+  if(action == EZ_NTP_TRACE_FAILED)
+    status = EXIT_FAILURE;
+  else
+    {
+      metrics.error = error;
+      metrics.last_delay = samples[0].delay;
+      metrics.last_offset = offset;
+      metrics.last_tp = home_tp;
+      metrics.samples += 1;
+      metrics_observe(&metrics.offsets, offset);
+      shm_publish(EZ_NTP_SHM_SYNCHRONIZED, 0, error, &home_tp);
+
+      if(error > once_max_error)
+	status = EZ_ONCE_INACCURATE;
+    }
+
+  metrics_write();
+
+  if(disable_all_logs == 0)
+    syslog(status == EXIT_FAILURE ? LOG_ERR : LOG_INFO,
+	   "%s, offset %ld usec, error %ld usec, %d of %d exchanges",
+	   method, offset, error, count, exchanges);
+
+  printf("%s, offset %ld usec, error %ld usec, %d of %d exchanges, "
+	 "%ld ms\n", method, offset, error, count, exchanges,
+	 once_deadline - once_remaining(&start_tp));
+  return status;
+}
+
+static int once_wait(struct ez_ntp_query *query,
+		     const struct timespec *start_tp)
+{
+  int rc = 0;
+  long remaining = 0;
+  struct pollfd pfd;
+
+  /*
+  ** Unlike ez_ntp_query_wait(), the deadline covers the connection and
+  ** the response together.
+  */
+
+  for(rc = EZ_NTP_AGAIN; rc == EZ_NTP_AGAIN;)
+    {
+      if((remaining = once_remaining(start_tp)) <= 0)
+	{
+	  ez_ntp_query_cancel(query);
+	  query->error = ETIMEDOUT;
+	  return EZ_NTP_ERROR;
 	}
-      else if(disable_all_logs == 0)
-	syslog(LOG_ERR, "gettimeofday() failed, %s", strerror(errno));
 
-      ez_close(sock_fd);
-      sock_fd = -1;
-      sleep(1);
+      pfd.fd = ez_ntp_query_fd(query);
+      pfd.events = ez_ntp_query_events(query);
+      pfd.revents = 0;
+
+      if(pfd.fd < 0)
+	return EZ_NTP_ERROR;
+
+      rc = poll(&pfd, 1, (int) remaining);
+
+      if(rc == -1 && errno == EINTR)
+	rc = EZ_NTP_AGAIN;
+      else if(rc == -1)
+	{
+	  query->error = errno;
+	  ez_ntp_query_cancel(query);
+	  return EZ_NTP_ERROR;
+	}
+      else if(rc == 0)
+	rc = EZ_NTP_AGAIN;
+      else
+	rc = ez_ntp_query_process(query, pfd.revents);
     }
 
-  return EXIT_SUCCESS;
+  return rc;
+}
+
+static long once_remaining(const struct timespec *start_tp)
+{
+  struct timespec now_tp;
+
+  clock_gettime(CLOCK_MONOTONIC, &now_tp);
+  return once_deadline -
+    ((long) (now_tp.tv_sec - start_tp->tv_sec) * 1000L +
+     (now_tp.tv_nsec - start_tp->tv_nsec) / 1000000L);
+}
+
+static int drift_read(void)
+{
+  char buffer[64];
+  char *endptr;
+  double value = 0.0;
+  int fd = -1;
+  ssize_t rc = 0;
+
+  if((fd = open(drift_path, O_RDONLY)) == -1)
+    return -1;
+
+  memset(buffer, 0, sizeof(buffer));
+  rc = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+
+  if(rc <= 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  errno = 0;
+  value = strtod(buffer, &endptr);
+
+  if(errno == ERANGE || endptr == buffer ||
+     value < -EZ_MAX_FREQUENCY || value > EZ_MAX_FREQUENCY)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  frequency = value;
+  frequency_valid = 1;
+  return 0;
 }
 
-static void onalarm(int notused)
+static int slew_clock(long usec)
 {
-  (void) notused;
+  struct timeval delta_tp;
+  struct timeval olddelta_tp;
+
+  /*
+  ** Corrections abandoned by a new adjtime() were never applied.
+  */
+
+  ez_ntp_usec_to_timeval(usec, &delta_tp);
+  memset(&olddelta_tp, 0, sizeof(olddelta_tp));
+
+  if(adjtime(&delta_tp, &olddelta_tp) != 0)
+    return -1;
+
+  applied += usec - ez_ntp_timeval_to_usec(&olddelta_tp);
+  corrections += usec - ez_ntp_timeval_to_usec(&olddelta_tp);
+  return 0;
+}
+
+static long applied_total(void)
+{
+  struct timeval olddelta_tp;
+
+  /*
+  ** The corrections requested thus far less the slew still outstanding.
+  */
+
+  memset(&olddelta_tp, 0, sizeof(olddelta_tp));
+
+  if(adjtime(0, &olddelta_tp) != 0)
+    return applied;
+
+  return applied - ez_ntp_timeval_to_usec(&olddelta_tp);
+}
+
+static void drift_write(void)
+{
+  char buffer[64];
+  int n = 0;
+
+  if(!frequency_valid || strlen(drift_path) == 0)
+    return;
+
+  /*
+  ** Replace the drift file atomically.
+  */
+
+  n = snprintf(buffer, sizeof(buffer), "%.3f\n", frequency);
+
+  if(!(n > 0 && n < (int) sizeof(buffer)))
+    return;
+
+  if(ez_replace_file(drift_path, buffer, (size_t) n, 1) != 0)
+    return;
+
+  gettimeofday(&drift_tp, 0);
+}
+
+static void holdover_apply(void)
+{
+  long drift = 0;
+  long elapsed = 0;
+  long error = 0;
+  long interval = 0;
+  struct timeval delta_tp;
+  struct timeval tp;
+
+  if(holdover_limit == 0 || sync_tp.tv_sec == 0 ||
+     ez_ntp_gettime(&tp) != 0)
+    {
+      shm_publish(EZ_NTP_SHM_UNSYNCHRONIZED, 0, 0, 0);
+      return;
+    }
+
+  timersub(&tp, &sync_tp, &delta_tp);
+  elapsed = ez_ntp_timeval_to_usec(&delta_tp);
+
+  if(!holdover)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_INFO, "%s", "entering holdover");
+
+      holdover = 1;
+      metrics.holdovers += 1;
+    }
+
+  /*
+  ** Slew by the drift expected since the previous adjustment.
+  */
+
+  timersub(&tp, &adjust_tp, &delta_tp);
+  interval = ez_ntp_timeval_to_usec(&delta_tp);
+
+  if(frequency_valid && interval > 0)
+    {
+      drift = (long) (frequency * (double) interval / 1000000.0);
+
+      if(drift != 0 && slew_clock(drift) != 0)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "adjtime() failed, %s", strerror(errno));
+	}
+      else
+	adjust_tp = tp;
+    }
+
+  error = sync_error + (long) ((double) elapsed * EZ_NTP_SHM_PHI / 1000000.0);
+  metrics.changed = 1;
+  metrics.error = error;
+
+  if(elapsed > holdover_limit * 1000000L)
+    shm_publish(EZ_NTP_SHM_UNSYNCHRONIZED, 0, 0, 0);
+  else
+    {
+      shm_publish(EZ_NTP_SHM_SYNCHRONIZED, 0, error, &tp);
+      trace_sample(EZ_NTP_TRACE_HOLDOVER, 0, 0, error);
+    }
+}
+
+static int shm_init(const char *path)
+{
+  int err = 0;
+  int fd = -1;
+  void *page = 0;
+
+  if((fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP |
+		S_IROTH)) == -1)
+    return -1;
+
+  if(ftruncate(fd, (off_t) sizeof(struct ez_ntp_shm)) != 0)
+    {
+      err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+
+  page = mmap(0, sizeof(struct ez_ntp_shm), PROT_READ | PROT_WRITE,
+	      MAP_SHARED, fd, 0);
+  err = errno;
+  close(fd);
+
+  if(page == MAP_FAILED)
+    {
+      errno = err;
+      return -1;
+    }
+
+  shm = (struct ez_ntp_shm *) page;
+  __atomic_store_n(&shm->sequence, shm->sequence | 1U, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  shm->magic = EZ_NTP_SHM_MAGIC;
+  shm->version = EZ_NTP_SHM_VERSION;
+  shm->status = EZ_NTP_SHM_UNSYNCHRONIZED;
+  __atomic_store_n(&shm->sequence, shm->sequence + 1U, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void trace_failure(const struct ez_ntp_query *query)
+{
+  struct ez_ntp_trace_record record;
+
+  if(!trace)
+    return;
+
+  memset(&record, 0, sizeof(record));
+  record.action = EZ_NTP_TRACE_FAILED;
+  record.address = trace_peer.sin_addr.s_addr;
+  record.port = trace_peer.sin_port;
+  record.state = (uint16_t) query->state;
+  record.transmit_usec = ez_ntp_timeval_to_usec(&query->sample.transmit_tp);
+  record.value = query->error;
+  ez_ntp_trace_write(trace, &record);
+}
+
+static void trace_sample(int action, const struct ez_ntp_sample *sample,
+			 long offset, long value)
+{
+  struct ez_ntp_trace_record record;
+
+  /*
+  ** Holdover records have no sample.
+  */
+
+  if(!trace)
+    return;
+
+  memset(&record, 0, sizeof(record));
+  record.action = (int16_t) action;
+  record.address = trace_peer.sin_addr.s_addr;
+  record.offset = offset;
+  record.port = trace_peer.sin_port;
+  record.value = value;
+
+  if(sample)
+    {
+      record.delay = sample->delay;
+      record.receive_usec = ez_ntp_timeval_to_usec(&sample->receive_tp);
+      record.server_usec = ez_ntp_timeval_to_usec
+	(&sample->response.server_tp);
+      record.stratum = (int16_t) sample->response.stratum;
+      record.transmit_usec = ez_ntp_timeval_to_usec(&sample->transmit_tp);
+    }
+
+  ez_ntp_trace_write(trace, &record);
+}
+
+static void update_frequency(long offset, const struct timeval *tp)
+{
+  double rate = 0.0;
+  long elapsed = 0;
+  struct timeval delta_tp;
+
+  if(labs(offset) >= 1000000L)
+    return;
+
+  if(!window_valid)
+    {
+      corrections = 0;
+      window_offset = offset;
+      window_tp = *tp;
+      window_valid = 1;
+      return;
+    }
+
+  timersub(tp, &window_tp, &delta_tp);
+  elapsed = ez_ntp_timeval_to_usec(&delta_tp);
+
+  if(elapsed < EZ_FREQUENCY_WINDOW * 1000000L)
+    return;
+
+  /*
+  ** The correction rate the clock required over the window.
+  */
+
+  rate = (double) (offset - window_offset + corrections) /
+    (double) elapsed * 1000000.0;
+
+  if(rate > EZ_MAX_FREQUENCY)
+    rate = EZ_MAX_FREQUENCY;
+  else if(rate < -EZ_MAX_FREQUENCY)
+    rate = -EZ_MAX_FREQUENCY;
+
+  if(frequency_valid)
+    frequency += (rate - frequency) / 4.0;
+  else
+    frequency = rate;
+
+  frequency_valid = 1;
+  corrections = 0;
+  window_offset = offset;
+  window_tp = *tp;
+  timersub(tp, &drift_tp, &delta_tp);
+
+  if(drift_tp.tv_sec == 0 || delta_tp.tv_sec >= EZ_DRIFT_INTERVAL)
+    drift_write();
+}
+
+static void shm_publish(int status, long offset, long error,
+			const struct timeval *tp)
+{
+  uint32_t sequence = 0;
+
+  if(!shm)
+    return;
+
+  /*
+  ** A null tp only updates the status.
+  */
+
+  sequence = shm->sequence;
+  __atomic_store_n(&shm->sequence, sequence + 1U, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&shm->status, (int32_t) status, __ATOMIC_RELAXED);
+
+  if(tp)
+    {
+      __atomic_store_n(&shm->error, (int64_t) error, __ATOMIC_RELAXED);
+      __atomic_store_n(&shm->offset, (int64_t) offset, __ATOMIC_RELAXED);
+      __atomic_store_n
+	(&shm->update_sec, (int64_t) tp->tv_sec, __ATOMIC_RELAXED);
+      __atomic_store_n
+	(&shm->update_usec, (int64_t) tp->tv_usec, __ATOMIC_RELAXED);
+    }
+
+  __atomic_store_n(&shm->sequence, sequence + 2U, __ATOMIC_RELEASE);
+}
+
+static int metrics_append(char *buffer, size_t size, size_t *length,
+			  const char *format, ...)
+{
+  int n = 0;
+  va_list ap;
+
+  if(*length >= size)
+    return -1;
+
+  va_start(ap, format);
+  n = vsnprintf(buffer + *length, size - *length, format, ap);
+  va_end(ap);
+
+  if(!(n >= 0 && n < (int) (size - *length)))
+    return -1;
+
+  *length += (size_t) n;
+  return 0;
+}
+
+static int metrics_append_histogram(char *buffer, size_t size,
+				    size_t *length, const char *name,
+				    const char *help,
+				    const struct metrics_histogram *histogram)
+{
+  size_t i = 0;
+  unsigned long count = 0;
+
+  if(metrics_append(buffer, size, length,
+		    "# HELP %s %s\n# TYPE %s histogram\n",
+		    name, help, name) != 0)
+    return -1;
+
+  for(i = 0; i < EZ_METRICS_BUCKETS; i++)
+    {
+      count += histogram->buckets[i];
+
+      if(i + 1 < EZ_METRICS_BUCKETS)
+	{
+	  if(metrics_append(buffer, size, length, "%s_bucket{le=\"%g\"} %lu\n",
+			    name, (double) metrics_bounds[i] / 1000000.0,
+			    count) != 0)
+	    return -1;
+	}
+      else if(metrics_append(buffer, size, length,
+			     "%s_bucket{le=\"+Inf\"} %lu\n", name, count) != 0)
+	return -1;
+    }
+
+  return metrics_append(buffer, size, length, "%s_sum %.6f\n%s_count %lu\n",
+			name, histogram->sum / 1000000.0, name,
+			histogram->count);
+}
+
+static void metrics_failure(const struct ez_ntp_query *query)
+{
+  /*
+  ** Classify a failed query by the step at which it failed.
+  */
+
+  metrics.changed = 1;
+
+  if(query->state == EZ_NTP_STATE_CONNECTING)
+    {
+      if(query->error == ETIMEDOUT)
+	metrics.timeouts_connect += 1;
+      else
+	metrics.errors_connect += 1;
+    }
+  else if(query->error == ETIMEDOUT)
+    metrics.timeouts_recv += 1;
+  else if(query->error == EPROTO)
+    metrics.parse_failures += 1;
+  else
+    metrics.errors_recv += 1;
+}
+
+static void metrics_observe(struct metrics_histogram *histogram, long usec)
+{
+  size_t i = 0;
+
+  usec = labs(usec);
+
+  for(i = 0; i + 1 < EZ_METRICS_BUCKETS; i++)
+    if(usec <= metrics_bounds[i])
+      break;
+
+  histogram->buckets[i] += 1;
+  histogram->count += 1;
+  histogram->sum += (double) usec;
+  metrics.changed = 1;
+}
+
+static void metrics_write(void)
+{
+  char buffer[8192];
+  size_t length = 0;
+
+  if(!metrics.changed || strlen(metrics_path) == 0)
+    return;
+
+  metrics.changed = 0;
+
+  if(metrics_append
+     (buffer, sizeof(buffer), &length,
+      "# HELP ez_ntpc_samples_total Samples applied to the clock.\n"
+      "# TYPE ez_ntpc_samples_total counter\n"
+      "ez_ntpc_samples_total %lu\n"
+      "# HELP ez_ntpc_adjustments_total Clock adjustments by method.\n"
+      "# TYPE ez_ntpc_adjustments_total counter\n"
+      "ez_ntpc_adjustments_total{method=\"step\"} %lu\n"
+      "ez_ntpc_adjustments_total{method=\"slew\"} %lu\n"
+      "ez_ntpc_adjustments_total{method=\"none\"} %lu\n"
+      "ez_ntpc_adjustments_total{method=\"rejected\"} %lu\n"
+      "# HELP ez_ntpc_timeouts_total Query timeouts by step.\n"
+      "# TYPE ez_ntpc_timeouts_total counter\n"
+      "ez_ntpc_timeouts_total{step=\"connect\"} %lu\n"
+      "ez_ntpc_timeouts_total{step=\"recv\"} %lu\n"
+      "# HELP ez_ntpc_errors_total Other query failures by step.\n"
+      "# TYPE ez_ntpc_errors_total counter\n"
+      "ez_ntpc_errors_total{step=\"connect\"} %lu\n"
+      "ez_ntpc_errors_total{step=\"recv\"} %lu\n"
+      "# HELP ez_ntpc_parse_failures_total Malformed responses.\n"
+      "# TYPE ez_ntpc_parse_failures_total counter\n"
+      "ez_ntpc_parse_failures_total %lu\n"
+      "# HELP ez_ntpc_unsynchronized_total Unsynchronized responses.\n"
+      "# TYPE ez_ntpc_unsynchronized_total counter\n"
+      "ez_ntpc_unsynchronized_total %lu\n"
+      "# HELP ez_ntpc_offset_seconds The latest offset.\n"
+      "# TYPE ez_ntpc_offset_seconds gauge\n"
+      "ez_ntpc_offset_seconds %.6f\n"
+      "# HELP ez_ntpc_delay_seconds The latest round-trip delay.\n"
+      "# TYPE ez_ntpc_delay_seconds gauge\n"
+      "ez_ntpc_delay_seconds %.6f\n"
+      "# HELP ez_ntpc_jitter_seconds The RMS offset difference.\n"
+      "# TYPE ez_ntpc_jitter_seconds gauge\n"
+      "ez_ntpc_jitter_seconds %.6f\n"
+      "# HELP ez_ntpc_error_bound_seconds The estimated error bound.\n"
+      "# TYPE ez_ntpc_error_bound_seconds gauge\n"
+      "ez_ntpc_error_bound_seconds %.6f\n"
+      "# HELP ez_ntpc_holdover Whether the client is in holdover.\n"
+      "# TYPE ez_ntpc_holdover gauge\n"
+      "ez_ntpc_holdover %d\n"
+      "# HELP ez_ntpc_holdovers_total Holdover periods entered.\n"
+      "# TYPE ez_ntpc_holdovers_total counter\n"
+      "ez_ntpc_holdovers_total %lu\n"
+      "# HELP ez_ntpc_last_sample_timestamp_seconds The latest sample.\n"
+      "# TYPE ez_ntpc_last_sample_timestamp_seconds gauge\n"
+      "ez_ntpc_last_sample_timestamp_seconds %ld.%06ld\n",
+      metrics.samples, metrics.steps, metrics.slews, metrics.none,
+      metrics.rejected, metrics.timeouts_connect, metrics.timeouts_recv,
+      metrics.errors_connect, metrics.errors_recv, metrics.parse_failures,
+      metrics.unsynchronized, (double) metrics.last_offset / 1000000.0,
+      (double) metrics.last_delay / 1000000.0,
+      sqrt(metrics.jitter) / 1000000.0, (double) metrics.error / 1000000.0,
+      holdover, metrics.holdovers, (long) metrics.last_tp.tv_sec,
+      (long) metrics.last_tp.tv_usec) != 0 ||
+     metrics_append_histogram
+     (buffer, sizeof(buffer), &length, "ez_ntpc_offset_abs_seconds",
+      "Absolute offsets.", &metrics.offsets) != 0 ||
+     metrics_append_histogram
+     (buffer, sizeof(buffer), &length, "ez_ntpc_round_trip_seconds",
+      "Round-trip delays.", &metrics.delay) != 0 ||
+     metrics_append_histogram
+     (buffer, sizeof(buffer), &length, "ez_ntpc_offset_change_seconds",
+      "Absolute differences between successive offsets.",
+      &metrics.jitters) != 0)
+    return;
+
+  /*
+  ** Replace the metrics file atomically.
+  */
+
+  ez_replace_file(metrics_path, buffer, length, 0);
 }
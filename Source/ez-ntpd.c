@@ -29,9 +29,20 @@
 ** -- System Includes --
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <arpa/inet.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
 
 /*
 ** -- Local Includes --
@@ -40,29 +51,223 @@
 #define PIDFILE "/var/run/ez-ntpd.pid"
 
 #include "ez-common.h"
+#include "ez-ntp-trace.h"
+#include "ez-ntp.h"
+
+/*
+** Relay definitions. A relay polls its upstream servers, keeps a
+** software clock (the system clock plus relay_offset) and serves that
+** clock along with its stratum and estimated error. The system clock
+** itself is not modified.
+*/
+
+#define EZ_MAX_ERROR 16000000L /* Microseconds. */
+#define EZ_MAX_STRATUM 16
+#define EZ_MAX_UPSTREAMS 8
+#define EZ_PHI 15 /* Frequency tolerance, parts per million. */
+
+/*
+** Upgrade definitions. On SIGUSR2 the daemon executes its binary anew and
+** passes the listening socket over a UNIX socket (EZ_UPGRADE_ENV names the
+** descriptor). Once the new process acknowledges, the old process stops
+** accepting and drains its in-flight responses.
+*/
+
+#define EZ_DRAIN_TIMEOUT 10000 /* Milliseconds. */
+#define EZ_UPGRADE_ENV "EZ_NTPD_UPGRADE_FD"
+#define EZ_UPGRADE_TIMEOUT 10000 /* Milliseconds. */
+
+/*
+** Low-latency definitions. The main thread accepts and answers each
+** connection itself, spinning on the listening socket for busy_poll
+** microseconds after the last connection before it blocks.
+*/
+
+#define EZ_LOW_LATENCY_PRIORITY 50
+#define EZ_PREFAULT_STACK 65536
+
+/*
+** Interleaved definitions. The server remembers, per client address, the
+** stamp of its last response and the time the response was sent, and
+** reports both in the client's next response.
+*/
 
+#define EZ_INTERLEAVED_BITS 12
+#define EZ_INTERLEAVED_CLIENTS (1 << EZ_INTERLEAVED_BITS)
+
+/*
+** TCP Fast Open. Clients holding a cookie send EZ_NTP_REQUEST in their
+** SYN, the connection is accepted at once and the response follows the
+** SYN-ACK. The request is discarded.
+*/
+
+#define EZ_FAST_OPEN_QUEUE 256
+
+/*
+** Overload definitions. A descriptor is held in reserve. Once accept()
+** runs out of descriptors, the reserve is released, the pending connection
+** is accepted and reset, and the reserve is reclaimed. Other resource
+** failures back off from EZ_BACKOFF_MIN microseconds, doubling up to
+** EZ_BACKOFF_MAX. The overload ends after EZ_OVERLOAD_QUIET seconds
+** without failures; until then, responses linger at most
+** EZ_OVERLOAD_LINGER seconds.
+*/
+
+#define EZ_BACKOFF_MAX 100000L /* Microseconds. */
+#define EZ_BACKOFF_MIN 100L /* Microseconds. */
+#define EZ_OVERLOAD_LINGER 1 /* Seconds. */
+#define EZ_OVERLOAD_QUIET 1 /* Seconds. */
+
+struct interleaved_client
+{
+  in_addr_t address;
+  struct timeval served_tp;
+  struct timeval transmit_tp;
+};
+
+extern char **environ;
+static char **saved_argv = 0;
+static char config_file[PATH_MAX];
+static char metrics_path[PATH_MAX];
+static char program_path[PATH_MAX];
+static int argument_shutdown_before_close = 0;
+static int argument_so_linger = -1;
+static int cpu = -1;
+static int fast_open = 0;
+static int in_flight = 0;
+static int interleaved = 0;
+static int low_latency = 0;
+static int metrics_stopped = 0;
+static int multicast_fd = -1;
+static int overloaded = 0;
+static int relay_mode = 0;
+static int relay_started = 0;
+static int relay_stratum = EZ_MAX_STRATUM;
+static int reserve_fd = -1;
+static int signal_pipe[2] = {-1, -1};
+static int tsc = 0;
+static long backoff = 0;
+static long busy_poll = 0;
+static long overload_sec = 0;
+static long relay_error = EZ_MAX_ERROR;
+static long relay_offset = 0;
+static long trace_records = 65536;
+static pthread_mutex_t interleaved_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t relay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t multicast_thread;
+static pthread_t relay_thread;
+static size_t argument_upstreams_count = 0;
+static size_t upstreams_count = 0;
+static struct ez_ntp_trace *trace = 0;
+static struct interleaved_client *interleaved_clients = 0;
+static struct timeval relay_sync_tp;
+static struct timeval spin_tp;
+static struct sockaddr_in argument_upstreams[EZ_MAX_UPSTREAMS];
+static struct sockaddr_in multicast_addr;
+static struct sockaddr_in upstreams[EZ_MAX_UPSTREAMS];
+static unsigned int argument_multicast_interval = 1;
+static unsigned int multicast_interval = 1;
+static unsigned long accept_failures = 0;
+static unsigned long connections_accepted = 0;
+static unsigned long connections_dropped = 0;
+static unsigned long connections_refused = 0;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static int accept_shed(void);
+static int accept_wait(void);
+static int config_load(void);
+static int format_time(char *, size_t, const struct sockaddr_in *,
+		       struct timeval *);
+static int low_latency_wait(void);
+static int relay_start(void);
+static int upgrade(void);
+static int upgrade_receive(void);
+static struct interleaved_client *interleaved_find(in_addr_t);
+static struct interleaved_client *interleaved_slot(in_addr_t);
+static void accept_backoff(void);
+static void accept_failed(int);
+static void close_connection(int, int);
+static void interleaved_record(const struct sockaddr_in *,
+			       const struct timeval *);
+static void listen_init(const char *, long);
+static void low_latency_init(void);
+static void low_latency_reset(void);
+static void *metrics_fun(void *);
+static void metrics_write(void);
+static void *multicast_fun(void *);
+static void onsignal(int);
+static void overload_enter(const char *, int);
+static void overload_leave(void);
+static void relay_cleanup(void *);
+static void *relay_fun(void *);
+static void serve(int);
+static void threads_stop(void);
 static void *thread_fun(void *);
+static void trace_query(const struct ez_ntp_query *,
+			const struct sockaddr_in *);
 
 int main(int argc, char *argv[])
 {
   char *endptr;
+  char notify[64];
   char remote_host[128];
+  char trace_path[PATH_MAX];
   int *conn_fd = 0;
   int err = 0;
   int i = 0;
   int n = 0;
   int rc = 0;
   int tmpint = 0;
+  int upgrade_fd = -1;
+  int upgrading = 0;
+  long multicast_ttl = 1;
   long port_num = -1;
+  long tmplong = 0;
+  pthread_t metrics_thread = 0;
   pthread_t thread = 0;
   socklen_t length = 0;
+  struct sigaction act;
   struct sockaddr client;
   struct sockaddr_in servaddr;
   struct stat st;
 
+  memset(config_file, 0, sizeof(config_file));
+  memset(metrics_path, 0, sizeof(metrics_path));
+  memset(program_path, 0, sizeof(program_path));
+  saved_argv = argv;
+
   for(i = 0; i < argc; i++)
-    if(argv && argv[i] && strcmp(argv[i], "--disable-all-logs") == 0)
+    if(argv && argv[i] && strcmp(argv[i], "--config") == 0)
+      {
+	if(i + 1 < argc && argv[i + 1])
+	  n = snprintf(config_file, sizeof(config_file), "%s", argv[i + 1]);
+	else
+	  n = -1;
+
+	if(!(n > 0 && n < (int) sizeof(config_file)) || config_file[0] != '/')
+	  {
+	    fprintf(stderr, "%s", "Invalid configuration file, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(argv && argv[i] && strcmp(argv[i], "--disable-all-logs") == 0)
       disable_all_logs = 1;
+    else if(argv && argv[i] && strcmp(argv[i], "--foreground") == 0)
+      foreground = 1;
+    else if(argv && argv[i] && strcmp(argv[i], "--pidfile") == 0)
+      {
+	if(i + 1 < argc && argv[i + 1])
+	  n = snprintf(pidfile, sizeof(pidfile), "%s", argv[i + 1]);
+	else
+	  n = -1;
+
+	if(!(n >= 0 && n < (int) sizeof(pidfile)) ||
+	   (n > 0 && pidfile[0] != '/'))
+	  {
+	    fprintf(stderr, "%s", "Invalid pidfile, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
     else if(argv && argv[i] && strcmp(argv[i], "--shutdown-before-close") == 0)
       shutdown_before_close = 1;
 
@@ -72,16 +277,17 @@ int main(int argc, char *argv[])
       setlogmask(LOG_UPTO(LOG_INFO));
     }
 
-  if(stat(PIDFILE, &st) == 0)
+  if(strlen(pidfile) > 0 && stat(pidfile, &st) == 0)
     {
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "%s already exists, exiting", PIDFILE);
+	syslog(LOG_ERR, "%s already exists, exiting", pidfile);
 
-      fprintf(stderr, "%s already exists, exiting.\n", PIDFILE);
+      fprintf(stderr, "%s already exists, exiting.\n", pidfile);
       return EXIT_FAILURE;
     }
 
   memset(remote_host, 0, sizeof(remote_host));
+  memset(trace_path, 0, sizeof(trace_path));
 
   for(; *argv != 0; argv++)
     if(strcmp(*argv, "--host") == 0)
@@ -135,8 +341,244 @@ int main(int argc, char *argv[])
 	      so_linger = -1;
 	  }
       }
+    else if(strcmp(*argv, "--upstream") == 0)
+      {
+	argv++;
+
+	if(*argv == 0 || argument_upstreams_count >= EZ_MAX_UPSTREAMS ||
+	   ez_ntp_parse_address
+	   (*argv, &argument_upstreams[argument_upstreams_count]) != 0)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid upstream server, exiting");
+
+	    fprintf(stderr, "%s", "Invalid upstream server, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+
+	argument_upstreams_count += 1;
+      }
+    else if(strcmp(*argv, "--multicast") == 0)
+      {
+	argv++;
+
+	if(*argv == 0 ||
+	   ez_ntp_parse_address(*argv, &multicast_addr) != 0 ||
+	   !IN_MULTICAST(ntohl(multicast_addr.sin_addr.s_addr)))
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid multicast group, exiting");
+
+	    fprintf(stderr, "%s", "Invalid multicast group, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+
+	multicast_fd = 0;
+      }
+    else if(strcmp(*argv, "--multicast-interval") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    tmplong = strtol(*argv, &endptr, 10);
+
+	    if(errno == EINVAL || errno == ERANGE || endptr == *argv ||
+	       tmplong < 1 || tmplong > 60)
+	      {
+		if(disable_all_logs == 0)
+		  syslog(LOG_ERR, "%s",
+			 "invalid multicast interval, exiting");
+
+		fprintf(stderr, "%s",
+			"Invalid multicast interval, exiting.\n");
+		return EXIT_FAILURE;
+	      }
+
+	    argument_multicast_interval = (unsigned int) tmplong;
+	  }
+      }
+    else if(strcmp(*argv, "--busy-poll") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    busy_poll = strtol(*argv, &endptr, 10);
+
+	    if(errno == EINVAL || errno == ERANGE || endptr == *argv ||
+	       busy_poll < 0 || busy_poll > 1000000)
+	      {
+		if(disable_all_logs == 0)
+		  syslog(LOG_ERR, "%s", "invalid busy-poll value, exiting");
+
+		fprintf(stderr, "%s", "Invalid busy-poll value, exiting.\n");
+		return EXIT_FAILURE;
+	      }
+	  }
+      }
+    else if(strcmp(*argv, "--cpu") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    tmplong = strtol(*argv, &endptr, 10);
+
+	    if(errno == EINVAL || errno == ERANGE || endptr == *argv ||
+	       tmplong < 0 || tmplong > 1023)
+	      {
+		if(disable_all_logs == 0)
+		  syslog(LOG_ERR, "%s", "invalid CPU, exiting");
+
+		fprintf(stderr, "%s", "Invalid CPU, exiting.\n");
+		return EXIT_FAILURE;
+	      }
+
+	    cpu = (int) tmplong;
+	  }
+      }
+    else if(strcmp(*argv, "--fast-open") == 0)
+      fast_open = 1;
+    else if(strcmp(*argv, "--interleaved") == 0)
+      interleaved = 1;
+    else if(strcmp(*argv, "--low-latency") == 0)
+      low_latency = 1;
+    else if(strcmp(*argv, "--metrics-file") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    n = snprintf(metrics_path, sizeof(metrics_path), "%s", *argv);
+
+	    if(!(n > 0 && n < (int) sizeof(metrics_path) - 8))
+	      memset(metrics_path, 0, sizeof(metrics_path));
+	  }
+
+	if(metrics_path[0] != '/')
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid metrics file, exiting");
+
+	    fprintf(stderr, "%s", "Invalid metrics file, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--tsc") == 0)
+      tsc = 1;
+    else if(strcmp(*argv, "--trace") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    n = snprintf(trace_path, sizeof(trace_path), "%s", *argv);
+
+	    if(!(n > 0 && n < (int) sizeof(trace_path)))
+	      memset(trace_path, 0, sizeof(trace_path));
+	  }
+
+	if(trace_path[0] != '/')
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid trace path, exiting");
+
+	    fprintf(stderr, "%s", "Invalid trace path, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--trace-records") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    trace_records = strtol(*argv, &endptr, 10);
+	  }
+
+	if(*argv == 0 || errno == EINVAL || errno == ERANGE ||
+	   endptr == *argv || trace_records < EZ_NTP_TRACE_MIN_RECORDS ||
+	   trace_records > EZ_NTP_TRACE_MAX_RECORDS ||
+	   (trace_records & (trace_records - 1)) != 0)
+	  {
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "%s", "invalid trace records, exiting");
+
+	    fprintf(stderr, "%s", "Invalid trace records, exiting.\n");
+	    return EXIT_FAILURE;
+	  }
+      }
+    else if(strcmp(*argv, "--multicast-ttl") == 0)
+      {
+	argv++;
+
+	if(*argv != 0)
+	  {
+	    errno = 0;
+	    multicast_ttl = strtol(*argv, &endptr, 10);
+
+	    if(errno == EINVAL || errno == ERANGE || endptr == *argv ||
+	       multicast_ttl < 0 || multicast_ttl > 255)
+	      {
+		if(disable_all_logs == 0)
+		  syslog(LOG_ERR, "%s", "invalid multicast TTL, exiting");
+
+		fprintf(stderr, "%s", "Invalid multicast TTL, exiting.\n");
+		return EXIT_FAILURE;
+	      }
+	  }
+      }
+
+  /*
+  ** The configuration file supplements the command line. It is read
+  ** again on SIGHUP.
+  */
+
+  argument_shutdown_before_close = shutdown_before_close;
+  argument_so_linger = so_linger;
 
-  if(port_num <= 0 || port_num > 65535)
+  if(config_load() != 0)
+    {
+      fprintf(stderr, "%s", "Invalid configuration, exiting.\n");
+      return EXIT_FAILURE;
+    }
+
+  /*
+  ** The upgrade channel occupies the first listening descriptor until
+  ** the listening socket arrives.
+  */
+
+  if(getenv(EZ_UPGRADE_ENV))
+    {
+      listen_fds = 1;
+      upgrading = 1;
+      unsetenv(EZ_UPGRADE_ENV);
+    }
+  else
+    listen_fds = ez_listen_fds();
+
+  /*
+  ** Remember the binary for upgrades. The working directory changes
+  ** once the process becomes a daemon.
+  */
+
+  if(saved_argv && saved_argv[0] && strchr(saved_argv[0], '/'))
+    {
+      if(!realpath(saved_argv[0], program_path))
+	memset(program_path, 0, sizeof(program_path));
+    }
+#if defined(__linux__)
+  else if(readlink("/proc/self/exe", program_path,
+		   sizeof(program_path) - 1) <= 0)
+    memset(program_path, 0, sizeof(program_path));
+#endif
+
+  if(listen_fds == 0 && (port_num <= 0 || port_num > 65535))
     {
       if(disable_all_logs == 0)
 	syslog(LOG_ERR, "%s",
@@ -165,34 +607,50 @@ int main(int argc, char *argv[])
 
   preconnect_init();
 
-  if((sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+  /*
+  ** Adopt the previous process's socket, the service manager's socket or
+  ** create a listening socket.
+  */
+
+  if(upgrading)
     {
-      err = errno;
+      if((upgrade_fd = upgrade_receive()) == -1)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "%s",
+		   "unable to receive the listening socket, exiting");
 
-      if(disable_all_logs == 0)
-	syslog(LOG_ERR, "socket() failed, %s, exiting", strerror(err));
+	  fprintf(stderr, "%s",
+		  "Unable to receive the listening socket, exiting.\n");
+	  return EXIT_FAILURE;
+	}
 
-      fprintf(stderr, "socket() failed, %s, exiting.\n", strerror(err));
-      return EXIT_FAILURE;
+      sock_fd = EZ_LISTEN_FDS_START;
     }
+  else if(listen_fds > 0)
+    sock_fd = EZ_LISTEN_FDS_START;
+  else
+    listen_init(remote_host, port_num);
 
-  tmpint = 1;
-
-  if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &tmpint, sizeof(int)) != 0)
+  if(fast_open)
     {
-      err = errno;
-
+#if defined(TCP_FASTOPEN)
+#if defined(__linux__)
+      tmpint = EZ_FAST_OPEN_QUEUE;
+#else
+      tmpint = 1;
+#endif
+
+      if(setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &tmpint,
+		    sizeof(tmpint)) != 0)
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "setsockopt() failed, %s", strerror(errno));
+#else
       if(disable_all_logs == 0)
-	syslog(LOG_ERR, "setsockopt() failed, %s, exiting", strerror(err));
-
-      fprintf(stderr, "setsockopt() failed, %s, exiting.\n", strerror(err));
-      return EXIT_FAILURE;
+	syslog(LOG_ERR, "%s", "TCP Fast Open is not supported");
+#endif
     }
 
-  /*
-  ** Issue a bind() call.
-  */
-
   memset(&servaddr, 0, sizeof(servaddr));
 
   if(strlen(remote_host) > 0)
@@ -200,86 +658,1241 @@ int main(int argc, char *argv[])
   else
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_port = htons((uint16_t) port_num);
+  if(interleaved)
+    if((interleaved_clients = calloc(EZ_INTERLEAVED_CLIENTS,
+				     sizeof(*interleaved_clients))) == 0)
+      {
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "%s", "calloc() failed, exiting");
 
-  if(bind(sock_fd, (const struct sockaddr *) &servaddr, sizeof(servaddr)) != 0)
-    {
-      err = errno;
+	fprintf(stderr, "%s", "calloc() failed, exiting.\n");
+	return EXIT_FAILURE;
+      }
 
-      if(disable_all_logs == 0)
-	syslog(LOG_ERR, "bind() failed, %s, exiting", strerror(err));
+  if(strlen(trace_path) > 0)
+    if((trace = ez_ntp_trace_create(trace_path,
+				    (uint32_t) trace_records)) == 0)
+      {
+	err = errno;
 
-      fprintf(stderr, "bind() failed, %s, exiting.\n", strerror(err));
-      return EXIT_FAILURE;
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "unable to map %s, %s, exiting", trace_path,
+		 strerror(err));
+
+	fprintf(stderr, "Unable to map %s, %s, exiting.\n", trace_path,
+		strerror(err));
+	return EXIT_FAILURE;
+      }
+
+  if(tsc)
+    {
+      if(ez_ntp_tsc_start() == 0)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_INFO, "%s", "timestamps are read from the TSC");
+	}
+      else if(disable_all_logs == 0)
+	syslog(LOG_ERR, "the TSC is unavailable, %s, using gettimeofday()",
+	       strerror(errno));
     }
 
   /*
-  ** Start accepting connections.
+  ** Start polling the upstream servers.
   */
 
-  if(listen(sock_fd, SOMAXCONN) != 0)
+  if(relay_mode && relay_start() != 0)
     {
-      err = errno;
-
-      if(disable_all_logs == 0)
-	syslog(LOG_ERR, "listen() failed, %s, exiting", strerror(err));
-
-      fprintf(stderr, "listen() failed, %s, exiting.\n", strerror(err));
+      fprintf(stderr, "%s", "Unable to start the relay, exiting.\n");
       return EXIT_FAILURE;
     }
 
-  for(;;)
-    {
-      conn_fd = malloc(sizeof(int));
+  /*
+  ** Start sending to the multicast group.
+  */
 
-      if(!conn_fd)
+  if(multicast_fd == 0)
+    {
+      if((multicast_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
 	{
+	  err = errno;
+
 	  if(disable_all_logs == 0)
-	    syslog(LOG_ERR, "malloc() failed");
+	    syslog(LOG_ERR, "socket() failed, %s, exiting", strerror(err));
 
-	  sleep(1);
-	  continue;
+	  fprintf(stderr, "socket() failed, %s, exiting.\n", strerror(err));
+	  return EXIT_FAILURE;
 	}
 
-      length = sizeof(client);
+      tmpint = (int) multicast_ttl;
+      setsockopt(multicast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &tmpint,
+		 sizeof(tmpint));
+      tmpint = 1;
+      setsockopt(multicast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &tmpint,
+		 sizeof(tmpint));
 
-      if((*conn_fd = accept(sock_fd, &client, &length)) >= 0)
-	{
-	  shutdown(*conn_fd, SHUT_RD);
+      if(strlen(remote_host) > 0)
+	if(setsockopt(multicast_fd, IPPROTO_IP, IP_MULTICAST_IF,
+		      &servaddr.sin_addr, sizeof(servaddr.sin_addr)) != 0)
+	  {
+	    err = errno;
 
-	  if((rc = pthread_create(&thread, 0, thread_fun, conn_fd)) != 0)
-	    {
-	      if(disable_all_logs == 0)
-		syslog
-		  (LOG_ERR, "pthread_create() failed, error code = %d", rc);
+	    if(disable_all_logs == 0)
+	      syslog(LOG_ERR, "setsockopt() failed, %s, exiting",
+		     strerror(err));
 
-	      ez_close(*conn_fd);
-	      free(conn_fd);
-	    }
-	}
-      else
+	    fprintf(stderr, "setsockopt() failed, %s, exiting.\n",
+		    strerror(err));
+	    return EXIT_FAILURE;
+	  }
+
+      if((rc = pthread_create(&multicast_thread, 0, multicast_fun, 0)) != 0)
 	{
 	  if(disable_all_logs == 0)
-	    syslog(LOG_ERR, "accept() failed, %s", strerror(errno));
+	    syslog(LOG_ERR, "pthread_create() failed, error code = %d, "
+		   "exiting", rc);
 
+	  fprintf(stderr, "pthread_create() failed, error code = %d, "
+		  "exiting.\n", rc);
+	  return EXIT_FAILURE;
+	}
+
+    }
+
+  /*
+  ** SIGHUP reloads the configuration file and SIGUSR2 upgrades the
+  ** binary. The handlers write to a pipe which is polled with the
+  ** listening socket, so a signal arriving at any moment wakes the loop.
+  */
+
+  if(pipe(signal_pipe) != 0)
+    {
+      err = errno;
+
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "pipe() failed, %s, exiting", strerror(err));
+
+      fprintf(stderr, "pipe() failed, %s, exiting.\n", strerror(err));
+      return EXIT_FAILURE;
+    }
+
+  for(i = 0; i < 2; i++)
+    {
+      fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+      fcntl(signal_pipe[i], F_SETFL,
+	    fcntl(signal_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+    }
+
+  act.sa_handler = onsignal;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;
+  sigaction(SIGHUP, &act, 0);
+  sigaction(SIGUSR2, &act, 0);
+
+  if(upgrade_fd > -1)
+    {
+      /*
+      ** The previous process stops accepting once it has our
+      ** acknowledgment.
+      */
+
+      if(write(upgrade_fd, "1", 1) != 1)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "%s", "unable to acknowledge the upgrade, exiting");
+
+	  fprintf(stderr, "%s",
+		  "Unable to acknowledge the upgrade, exiting.\n");
+	  return EXIT_FAILURE;
+	}
+
+      close(upgrade_fd);
+
+      if(disable_all_logs == 0)
+	syslog(LOG_INFO, "%s", "upgrade complete");
+    }
+
+  if(low_latency)
+    low_latency_init();
+
+  /*
+  ** The reserve descriptor is sacrificed when accept() runs out of
+  ** descriptors.
+  */
+
+  if((reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+    if(disable_all_logs == 0)
+      syslog(LOG_ERR, "unable to reserve a descriptor, %s", strerror(errno));
+
+  if(strlen(metrics_path) > 0)
+    {
+      if((rc = pthread_create(&metrics_thread, 0, metrics_fun, 0)) != 0)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "pthread_create() failed, error code = %d, "
+		   "exiting", rc);
+
+	  fprintf(stderr, "pthread_create() failed, error code = %d, "
+		  "exiting.\n", rc);
+	  return EXIT_FAILURE;
+	}
+
+      pthread_detach(metrics_thread);
+    }
+
+  n = snprintf(notify, sizeof(notify), "READY=1\nMAINPID=%ld",
+	       (long) getpid());
+
+  if(n > 0 && n < (int) sizeof(notify))
+    ez_notify(notify);
+  else
+    ez_notify("READY=1");
+
+  for(;;)
+    {
+      if(reload_requested)
+	{
+	  reload_requested = 0;
+	  ez_notify("RELOADING=1");
+
+	  if(config_load() == 0)
+	    {
+	      if(relay_mode)
+		relay_start();
+
+	      if(disable_all_logs == 0)
+		syslog(LOG_INFO, "%s", "configuration reloaded");
+	    }
+
+	  ez_notify("READY=1");
+	}
+
+      if(upgrade_requested)
+	{
+	  upgrade_requested = 0;
+
+	  if(upgrade() == 0)
+	    {
+	      /*
+	      ** The metrics file now belongs to the new process.
+	      */
+
+	      __atomic_store_n(&metrics_stopped, 1, __ATOMIC_RELAXED);
+	      break;
+	    }
+	}
+
+      if(low_latency ? low_latency_wait() != 0 : accept_wait() != 0)
+	continue;
+
+      conn_fd = malloc(sizeof(int));
+
+      if(!conn_fd)
+	{
+	  overload_enter("malloc()", ENOMEM);
+	  accept_backoff();
+	  continue;
+	}
+
+      length = sizeof(client);
+
+      if((*conn_fd = accept(sock_fd, &client, &length)) >= 0)
+	{
+	  __atomic_add_fetch(&connections_accepted, 1, __ATOMIC_RELAXED);
+	  shutdown(*conn_fd, SHUT_RD);
+
+	  if(low_latency)
+	    {
+	      serve(*conn_fd);
+	      free(conn_fd);
+	      overload_leave();
+	      continue;
+	    }
+
+	  __atomic_add_fetch(&in_flight, 1, __ATOMIC_SEQ_CST);
+
+	  if((rc = pthread_create(&thread, 0, thread_fun, conn_fd)) != 0)
+	    {
+	      /*
+	      ** Reset the connection rather than linger on it.
+	      */
+
+	      __atomic_sub_fetch(&in_flight, 1, __ATOMIC_SEQ_CST);
+	      __atomic_add_fetch(&connections_dropped, 1, __ATOMIC_RELAXED);
+	      close_connection(*conn_fd, 0);
+	      free(conn_fd);
+	      overload_enter("pthread_create()", rc);
+	      accept_backoff();
+	    }
+	  else
+	    overload_leave();
+	}
+      else
+	{
+	  err = errno;
 	  free(conn_fd);
+	  accept_failed(err);
+	}
+    }
+
+  /*
+  ** The new process owns the listening socket. Drain the in-flight
+  ** responses.
+  */
+
+  close(sock_fd);
+  sock_fd = -1;
+  threads_stop();
+
+  for(i = 0; i < EZ_DRAIN_TIMEOUT / 10; i++)
+    if(__atomic_load_n(&in_flight, __ATOMIC_SEQ_CST) > 0)
+      poll(0, 0, 10);
+    else
+      break;
+
+  if(disable_all_logs == 0)
+    syslog(LOG_INFO, "%s", "upgraded, exiting");
+
+  return EXIT_SUCCESS;
+}
+
+static int accept_shed(void)
+{
+  int fd = -1;
+  struct pollfd pfd;
+
+  /*
+  ** Release the reserve descriptor, accept and reset the oldest pending
+  ** connection and reclaim the descriptor. Another thread may claim the
+  ** released descriptor first; the reserve is then restored on a later
+  ** attempt.
+  */
+
+  if(reserve_fd == -1)
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  if(reserve_fd == -1)
+    return -1;
+
+  /*
+  ** The descriptor shortage may precede the connection.
+  */
+
+  pfd.events = POLLIN;
+  pfd.fd = sock_fd;
+  pfd.revents = 0;
+
+  if(poll(&pfd, 1, 0) != 1)
+    return -1;
+
+  close(reserve_fd);
+
+  if((fd = accept(sock_fd, 0, 0)) >= 0)
+    {
+      __atomic_add_fetch(&connections_refused, 1, __ATOMIC_RELAXED);
+      close_connection(fd, 0);
+    }
+
+  reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return fd >= 0 ? 0 : -1;
+}
+
+static int accept_wait(void)
+{
+  char buffer[16];
+  int rc = 0;
+  struct pollfd pfd[2];
+
+  /*
+  ** Returns 0 once a connection is pending. A signal or an error
+  ** returns -1 after the pipe is drained.
+  */
+
+  pfd[0].events = POLLIN;
+  pfd[0].fd = sock_fd;
+  pfd[0].revents = 0;
+  pfd[1].events = POLLIN;
+  pfd[1].fd = signal_pipe[0];
+  pfd[1].revents = 0;
+
+  if((rc = poll(pfd, 2, -1)) == -1)
+    {
+      if(errno != EINTR)
+	accept_failed(errno);
+
+      return -1;
+    }
+
+  if(pfd[1].revents != 0)
+    {
+      while(read(signal_pipe[0], buffer, sizeof(buffer)) > 0)
+	;
+
+      return -1;
+    }
+
+  return (pfd[0].revents & POLLIN) ? 0 : -1;
+}
+
+static void accept_backoff(void)
+{
+  struct timespec ts;
+
+  /*
+  ** Yield briefly rather than stall while the backlog overflows. A
+  ** signal interrupts the wait.
+  */
+
+  if(backoff == 0)
+    backoff = EZ_BACKOFF_MIN;
+  else if(backoff < EZ_BACKOFF_MAX / 2)
+    backoff *= 2;
+  else
+    backoff = EZ_BACKOFF_MAX;
+
+  ts.tv_sec = (time_t) (backoff / 1000000L);
+  ts.tv_nsec = (backoff % 1000000L) * 1000L;
+  nanosleep(&ts, 0);
+}
+
+static void accept_failed(int err)
+{
+  switch(err)
+    {
+    case EINTR:
+      break;
+    case ECONNABORTED:
+    case EPROTO:
+#if defined(__linux__)
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case ENONET:
+    case ENOPROTOOPT:
+    case EOPNOTSUPP:
+#endif
+      /*
+      ** The pending connection failed; the next one may be accepted at
+      ** once.
+      */
+
+      break;
+    case EMFILE:
+    case ENFILE:
+      overload_enter("accept()", err);
+
+      if(accept_shed() != 0)
+	accept_backoff();
+
+      break;
+    default:
+      __atomic_add_fetch(&accept_failures, 1, __ATOMIC_RELAXED);
+      overload_enter("accept()", err);
+      accept_backoff();
+      break;
+    }
+}
+
+static void close_connection(int fd, int linger)
+{
+  struct linger sol;
+
+  /*
+  ** A zero linger resets the connection and releases it at once.
+  */
+
+  if(linger >= 0)
+    {
+      sol.l_onoff = 1;
+      sol.l_linger = linger;
+      setsockopt(fd, SOL_SOCKET, SO_LINGER, &sol, sizeof(sol));
+    }
+
+  if(close(fd) != 0)
+    if(disable_all_logs == 0)
+      syslog(LOG_ERR, "close() failed, %s", strerror(errno));
+}
+
+static int config_load(void)
+{
+  FILE *file = 0;
+  char *endptr;
+  char *key = 0;
+  char *saveptr = 0;
+  char *value = 0;
+  char line[512];
+  int line_number = 0;
+  int linger = argument_so_linger;
+  int shutdown_first = argument_shutdown_before_close;
+  long tmplong = 0;
+  size_t count = argument_upstreams_count;
+  struct sockaddr_in addresses[EZ_MAX_UPSTREAMS];
+  unsigned int interval = argument_multicast_interval;
+
+  /*
+  ** One option per line: multicast-interval SECONDS,
+  ** shutdown-before-close yes|no, so-linger TIMEOUT or
+  ** upstream IP-ADDRESS:PORT. The file's upstream servers follow those
+  ** of the command line. An invalid file is ignored in its entirety.
+  */
+
+  memcpy(addresses, argument_upstreams, sizeof(addresses));
+
+  if(strlen(config_file) > 0)
+    {
+      if((file = fopen(config_file, "r")) == 0)
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "fopen() failed for %s, %s", config_file,
+		   strerror(errno));
+
+	  fprintf(stderr, "fopen() failed for %s, %s.\n", config_file,
+		  strerror(errno));
+	  return -1;
+	}
+
+      while(fgets(line, (int) sizeof(line), file))
+	{
+	  line_number += 1;
+	  line[strcspn(line, "#\r\n")] = 0;
+
+	  if((key = strtok_r(line, " \t", &saveptr)) == 0)
+	    continue;
+
+	  if((value = strtok_r(0, " \t", &saveptr)) == 0 ||
+	     strtok_r(0, " \t", &saveptr) != 0)
+	    break;
+
+	  errno = 0;
+
+	  if(strcmp(key, "multicast-interval") == 0)
+	    {
+	      tmplong = strtol(value, &endptr, 10);
+
+	      if(errno == ERANGE || endptr == value || *endptr != 0 ||
+		 tmplong < 1 || tmplong > 60)
+		break;
+
+	      interval = (unsigned int) tmplong;
+	    }
+	  else if(strcmp(key, "shutdown-before-close") == 0)
+	    {
+	      if(strcmp(value, "yes") == 0)
+		shutdown_first = 1;
+	      else if(strcmp(value, "no") == 0)
+		shutdown_first = 0;
+	      else
+		break;
+	    }
+	  else if(strcmp(key, "so-linger") == 0)
+	    {
+	      tmplong = strtol(value, &endptr, 10);
+
+	      if(errno == ERANGE || endptr == value || *endptr != 0 ||
+		 tmplong < -1 || tmplong > INT_MAX)
+		break;
+
+	      linger = (int) tmplong;
+	    }
+	  else if(strcmp(key, "upstream") == 0)
+	    {
+	      if(count >= EZ_MAX_UPSTREAMS ||
+		 ez_ntp_parse_address(value, &addresses[count]) != 0)
+		break;
+
+	      count += 1;
+	    }
+	  else
+	    break;
+	}
+
+      if(!feof(file))
+	{
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "%s:%d: invalid option, configuration ignored",
+		   config_file, line_number);
+
+	  fprintf(stderr, "%s:%d: invalid option, configuration ignored.\n",
+		  config_file, line_number);
+	  fclose(file);
+	  return -1;
+	}
+
+      fclose(file);
+    }
+
+  pthread_mutex_lock(&relay_mutex);
+
+  if(count > 0 && relay_mode == 0)
+    {
+      relay_error = EZ_MAX_ERROR;
+      relay_stratum = EZ_MAX_STRATUM;
+    }
+
+  memcpy(upstreams, addresses, sizeof(upstreams));
+  upstreams_count = count;
+  relay_mode = count > 0;
+  pthread_mutex_unlock(&relay_mutex);
+  multicast_interval = interval;
+  shutdown_before_close = shutdown_first;
+  so_linger = linger;
+  return 0;
+}
+
+static void *relay_fun(void *arg)
+{
+  int best_stratum = 0;
+  int rc = 0;
+  int stratum = 0;
+  long best_distance = 0;
+  long best_offset = 0;
+  long distance = 0;
+  size_t count = 0;
+  size_t i = 0;
+  size_t pending = 0;
+  struct ez_ntp_query queries[EZ_MAX_UPSTREAMS];
+  struct pollfd pfds[EZ_MAX_UPSTREAMS];
+  struct sockaddr_in addresses[EZ_MAX_UPSTREAMS];
+  struct timeval tp;
+
+  (void) arg;
+
+  if(low_latency)
+    low_latency_reset();
+
+  for(i = 0; i < EZ_MAX_UPSTREAMS; i++)
+    {
+      ez_ntp_query_init(&queries[i]);
+      queries[i].fast_open = fast_open;
+    }
+
+  pthread_cleanup_push(relay_cleanup, queries);
+
+  for(;;)
+    {
+      /*
+      ** The list may change on SIGHUP.
+      */
+
+      pthread_mutex_lock(&relay_mutex);
+      count = upstreams_count;
+      memcpy(addresses, upstreams, sizeof(addresses));
+      pthread_mutex_unlock(&relay_mutex);
+
+      if(count == 0)
+	{
 	  sleep(1);
+	  continue;
+	}
+
+      /*
+      ** Query the upstream servers concurrently.
+      */
+
+      for(i = 0; i < count; i++)
+	{
+	  queries[i].shutdown_before_close = shutdown_before_close;
+	  queries[i].so_linger = so_linger;
+	  ez_ntp_query_start(&queries[i], &addresses[i]);
+	}
+
+      for(;;)
+	{
+	  for(i = 0, pending = 0; i < count; i++)
+	    {
+	      pfds[i].events = ez_ntp_query_events(&queries[i]);
+	      pfds[i].fd = queries[i].fd;
+	      pfds[i].revents = 0;
+
+	      if(pfds[i].fd >= 0)
+		pending += 1;
+	    }
+
+	  if(pending == 0)
+	    break;
+
+	  if((rc = poll(pfds, (nfds_t) count, 8000)) == -1 &&
+	     errno == EINTR)
+	    continue;
+	  else if(rc <= 0)
+	    {
+	      for(i = 0; i < count; i++)
+		ez_ntp_query_cancel(&queries[i]);
+
+	      break;
+	    }
+
+	  for(i = 0; i < count; i++)
+	    if(pfds[i].fd >= 0 && pfds[i].revents != 0)
+	      ez_ntp_query_process(&queries[i], pfds[i].revents);
+	}
+
+      best_distance = LONG_MAX;
+
+      if(trace)
+	for(i = 0; i < count; i++)
+	  trace_query(&queries[i], &addresses[i]);
+
+      for(i = 0; i < count; i++)
+	{
+	  if(queries[i].state != EZ_NTP_STATE_FINISHED)
+	    continue;
+
+	  /*
+	  ** Plain servers do not report a stratum.
+	  */
+
+	  stratum = queries[i].sample.response.stratum;
+
+	  if(stratum == 0)
+	    stratum = 1;
+
+	  if(stratum >= EZ_MAX_STRATUM - 1 || queries[i].sample.delay < 0)
+	    continue;
+
+	  distance = queries[i].sample.response.error +
+	    queries[i].sample.delay / 2;
+
+	  if(distance < best_distance)
+	    {
+	      best_distance = distance;
+	      best_offset = queries[i].sample.offset;
+	      best_stratum = stratum + 1;
+	    }
+	}
+
+      if(best_distance < EZ_MAX_ERROR)
+	{
+	  ez_ntp_gettime(&tp);
+	  pthread_mutex_lock(&relay_mutex);
+	  relay_error = best_distance;
+	  relay_offset = best_offset;
+	  relay_stratum = best_stratum;
+	  relay_sync_tp = tp;
+	  pthread_mutex_unlock(&relay_mutex);
+	}
+      else if(disable_all_logs == 0)
+	syslog(LOG_ERR, "%s", "upstream servers are unavailable");
+
+      sleep(1);
+    }
+
+  pthread_cleanup_pop(0);
+  return 0;
+}
+
+static void relay_cleanup(void *arg)
+{
+  size_t i = 0;
+  struct ez_ntp_query *queries = arg;
+
+  for(i = 0; i < EZ_MAX_UPSTREAMS; i++)
+    ez_ntp_query_cancel(&queries[i]);
+}
+
+static int relay_start(void)
+{
+  int rc = 0;
+
+  if(relay_started)
+    return 0;
+
+  if((rc = pthread_create(&relay_thread, 0, relay_fun, 0)) != 0)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "pthread_create() failed, error code = %d", rc);
+
+      return -1;
+    }
+
+  relay_started = 1;
+  return 0;
+}
+
+static int format_time(char *buffer, size_t size,
+		       const struct sockaddr_in *addr, struct timeval *served_tp)
+{
+  int fields = 2;
+  int stratum = 0;
+  long error = 0;
+  long offset = 0;
+  struct ez_ntp_response response;
+  struct interleaved_client *client = 0;
+  struct timeval delta_tp;
+  struct timeval tp;
+
+  /*
+  ** Fetch the time.
+  */
+
+  if(ez_ntp_gettime(&tp) != 0)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "gettimeofday() failed, %s", strerror(errno));
+
+      return -1;
+    }
+
+  memset(&response, 0, sizeof(response));
+
+  if(relay_mode)
+    {
+      pthread_mutex_lock(&relay_mutex);
+      error = relay_error;
+      offset = relay_offset;
+      stratum = relay_stratum;
+
+      if(stratum < EZ_MAX_STRATUM)
+	{
+	  /*
+	  ** The error grows with the time since the last update.
+	  */
+
+	  timersub(&tp, &relay_sync_tp, &delta_tp);
+	  error += (long) delta_tp.tv_sec * EZ_PHI +
+	    (long) delta_tp.tv_usec * EZ_PHI / 1000000L;
+	}
+
+      pthread_mutex_unlock(&relay_mutex);
+
+      if(error >= EZ_MAX_ERROR)
+	{
+	  error = EZ_MAX_ERROR;
+	  stratum = EZ_MAX_STRATUM;
+	}
+
+      ez_ntp_usec_to_timeval(offset, &delta_tp);
+      timeradd(&tp, &delta_tp, &tp);
+    }
+
+  if(served_tp)
+    *served_tp = tp;
+
+  if(addr)
+    {
+      /*
+      ** Interleaved responses always carry the stratum and error.
+      */
+
+      pthread_mutex_lock(&interleaved_mutex);
+
+      if((client = interleaved_find(addr->sin_addr.s_addr)) != 0)
+	{
+	  response.previous_tp = client->served_tp;
+	  response.previous_transmit_tp = client->transmit_tp;
+	}
+
+      pthread_mutex_unlock(&interleaved_mutex);
+      fields = 8;
+    }
+  else if(relay_mode)
+    fields = 4;
+
+  response.error = error;
+  response.server_tp = tp;
+  response.stratum = stratum;
+  return ez_ntp_format(buffer, size, &response, fields);
+}
+
+static struct interleaved_client *interleaved_find(in_addr_t address)
+{
+  struct interleaved_client *client = 0;
+
+  /*
+  ** The caller holds interleaved_mutex. Collisions replace entries; an
+  ** entry held by another address is a miss.
+  */
+
+  client = interleaved_slot(address);
+
+  if(client->address != address || client->served_tp.tv_sec == 0)
+    return 0;
+
+  return client;
+}
+
+static struct interleaved_client *interleaved_slot(in_addr_t address)
+{
+  /*
+  ** Fibonacci hashing. The high bits of the product depend on every bit
+  ** of the address.
+  */
+
+  return &interleaved_clients
+    [(uint32_t) (ntohl(address) * 2654435761U) >>
+     (32 - EZ_INTERLEAVED_BITS)];
+}
+
+static void interleaved_record(const struct sockaddr_in *addr,
+			       const struct timeval *served_tp)
+{
+  long offset = 0;
+  struct interleaved_client *client = 0;
+  struct timeval delta_tp;
+  struct timeval tp;
+
+  /*
+  ** The response has left; its transmit time is now known.
+  */
+
+  ez_ntp_gettime(&tp);
+
+  if(relay_mode)
+    {
+      pthread_mutex_lock(&relay_mutex);
+      offset = relay_offset;
+      pthread_mutex_unlock(&relay_mutex);
+      ez_ntp_usec_to_timeval(offset, &delta_tp);
+      timeradd(&tp, &delta_tp, &tp);
+    }
+
+  pthread_mutex_lock(&interleaved_mutex);
+  client = interleaved_slot(addr->sin_addr.s_addr);
+  client->address = addr->sin_addr.s_addr;
+  client->served_tp = *served_tp;
+  client->transmit_tp = tp;
+  pthread_mutex_unlock(&interleaved_mutex);
+}
+
+static void listen_init(const char *remote_host, long port_num)
+{
+  int err = 0;
+  int tmpint = 0;
+  struct sockaddr_in servaddr;
+
+  if((sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    {
+      err = errno;
+
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "socket() failed, %s, exiting", strerror(err));
+
+      fprintf(stderr, "socket() failed, %s, exiting.\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+
+  tmpint = 1;
+
+  if(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &tmpint, sizeof(int)) != 0)
+    {
+      err = errno;
+
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "setsockopt() failed, %s, exiting", strerror(err));
+
+      fprintf(stderr, "setsockopt() failed, %s, exiting.\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+
+  /*
+  ** Issue a bind() call.
+  */
+
+  memset(&servaddr, 0, sizeof(servaddr));
+
+  if(strlen(remote_host) > 0)
+    servaddr.sin_addr.s_addr = inet_addr(remote_host);
+  else
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_port = htons((uint16_t) port_num);
+
+  if(bind(sock_fd, (const struct sockaddr *) &servaddr, sizeof(servaddr)) != 0)
+    {
+      err = errno;
+
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "bind() failed, %s, exiting", strerror(err));
+
+      fprintf(stderr, "bind() failed, %s, exiting.\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+
+  /*
+  ** Start accepting connections.
+  */
+
+  if(listen(sock_fd, SOMAXCONN) != 0)
+    {
+      err = errno;
+
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "listen() failed, %s, exiting", strerror(err));
+
+      fprintf(stderr, "listen() failed, %s, exiting.\n", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+}
+
+static int low_latency_wait(void)
+{
+  int rc = 0;
+  struct pollfd pfd;
+  struct timeval tp;
+
+  /*
+  ** Spin until a connection arrives, a signal is noted or the spin
+  ** period expires, then block with the signal pipe.
+  */
+
+  pfd.events = POLLIN;
+  pfd.fd = sock_fd;
+
+  for(;;)
+    {
+      pfd.revents = 0;
+
+      if((rc = poll(&pfd, 1, 0)) != 0 || reload_requested ||
+	 upgrade_requested)
+	break;
+
+      ez_ntp_gettime(&tp);
+
+      if(!timercmp(&tp, &spin_tp, <))
+	{
+	  rc = accept_wait() == 0 ? 1 : 0;
+	  break;
 	}
     }
 
-  return EXIT_SUCCESS;
+  if(rc != 1)
+    return -1;
+
+  ez_ntp_gettime(&tp);
+  spin_tp.tv_sec = (time_t) (busy_poll / 1000000L);
+  spin_tp.tv_usec = (suseconds_t) (busy_poll % 1000000L);
+  timeradd(&tp, &spin_tp, &spin_tp);
+  return 0;
 }
 
-static void *thread_fun(void *arg)
+static void low_latency_init(void)
+{
+  int err = 0;
+  size_t i = 0;
+  struct sched_param param;
+  volatile unsigned char stack[EZ_PREFAULT_STACK];
+
+  /*
+  ** Pin the serving thread, raise its priority and lock the process's
+  ** memory. Each step is optional; failures are logged.
+  */
+
+#if defined(__linux__)
+  if(cpu >= 0)
+    {
+      cpu_set_t set;
+
+      CPU_ZERO(&set);
+      CPU_SET((size_t) cpu, &set);
+
+      if((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+	 != 0)
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "pthread_setaffinity_np() failed, %s",
+		 strerror(err));
+    }
+#else
+  if(cpu >= 0)
+    if(disable_all_logs == 0)
+      syslog(LOG_ERR, "%s", "CPU affinity is not supported");
+#endif
+
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = EZ_LOW_LATENCY_PRIORITY;
+
+  if((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+    if(disable_all_logs == 0)
+      syslog(LOG_ERR, "pthread_setschedparam() failed, %s", strerror(err));
+
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    if(disable_all_logs == 0)
+      syslog(LOG_ERR, "mlockall() failed, %s", strerror(errno));
+
+  /*
+  ** Fault in the stack that serve() will use.
+  */
+
+  for(i = 0; i < sizeof(stack); i += 256)
+    stack[i] = 0;
+
+#if defined(SO_BUSY_POLL)
+  if(busy_poll > 0)
+    {
+      int value = busy_poll > INT_MAX ? INT_MAX : (int) busy_poll;
+
+      if(setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &value,
+		    sizeof(value)) != 0)
+	if(disable_all_logs == 0)
+	  syslog(LOG_ERR, "setsockopt() failed, %s", strerror(errno));
+    }
+#endif
+}
+
+static void low_latency_reset(void)
+{
+  struct sched_param param;
+
+  /*
+  ** Threads created by the serving thread must not inherit its
+  ** scheduling.
+  */
+
+  memset(&param, 0, sizeof(param));
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+#if defined(__linux__)
+  if(cpu >= 0)
+    {
+      cpu_set_t set;
+      long count = sysconf(_SC_NPROCESSORS_CONF);
+      long i = 0;
+
+      CPU_ZERO(&set);
+
+      for(i = 0; i < count && i < CPU_SETSIZE; i++)
+	CPU_SET((size_t) i, &set);
+
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+}
+
+static void *metrics_fun(void *arg)
+{
+  (void) arg;
+
+  while(!__atomic_load_n(&metrics_stopped, __ATOMIC_RELAXED))
+    {
+      metrics_write();
+      sleep(1);
+    }
+
+  return 0;
+}
+
+static void metrics_write(void)
+{
+  char buffer[4096];
+  int n = 0;
+  static unsigned long previous[6] = {0, 0, 0, 0, 0, 0};
+  static int written = 0;
+  struct timespec ts;
+  unsigned long current[6];
+
+  current[0] = __atomic_load_n(&connections_accepted, __ATOMIC_RELAXED);
+  current[1] = __atomic_load_n(&connections_refused, __ATOMIC_RELAXED);
+  current[2] = __atomic_load_n(&connections_dropped, __ATOMIC_RELAXED);
+  current[3] = __atomic_load_n(&accept_failures, __ATOMIC_RELAXED);
+  current[4] = (unsigned long) __atomic_load_n(&in_flight, __ATOMIC_SEQ_CST);
+  current[5] = 0;
+
+  /*
+  ** The server stops shedding once failures cease, whether or not another
+  ** connection has arrived.
+  */
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  if(__atomic_load_n(&overloaded, __ATOMIC_RELAXED) &&
+     (long) ts.tv_sec - __atomic_load_n(&overload_sec, __ATOMIC_RELAXED) <
+     EZ_OVERLOAD_QUIET)
+    current[5] = 1;
+
+  if(written && memcmp(current, previous, sizeof(current)) == 0)
+    return;
+
+  n = snprintf
+    (buffer, sizeof(buffer),
+     "# HELP ez_ntpd_connections_accepted_total Connections accepted.\n"
+     "# TYPE ez_ntpd_connections_accepted_total counter\n"
+     "ez_ntpd_connections_accepted_total %lu\n"
+     "# HELP ez_ntpd_connections_refused_total Connections reset at "
+     "accept() for want of descriptors.\n"
+     "# TYPE ez_ntpd_connections_refused_total counter\n"
+     "ez_ntpd_connections_refused_total %lu\n"
+     "# HELP ez_ntpd_connections_dropped_total Accepted connections closed "
+     "without a response.\n"
+     "# TYPE ez_ntpd_connections_dropped_total counter\n"
+     "ez_ntpd_connections_dropped_total %lu\n"
+     "# HELP ez_ntpd_accept_failures_total Other accept() failures.\n"
+     "# TYPE ez_ntpd_accept_failures_total counter\n"
+     "ez_ntpd_accept_failures_total %lu\n"
+     "# HELP ez_ntpd_in_flight Responses in progress.\n"
+     "# TYPE ez_ntpd_in_flight gauge\n"
+     "ez_ntpd_in_flight %lu\n"
+     "# HELP ez_ntpd_overloaded Whether the server is shedding load.\n"
+     "# TYPE ez_ntpd_overloaded gauge\n"
+     "ez_ntpd_overloaded %lu\n",
+     current[0], current[1], current[2], current[3], current[4],
+     current[5]);
+
+  if(!(n > 0 && n < (int) sizeof(buffer)))
+    return;
+
+  /*
+  ** Replace the metrics file atomically.
+  */
+
+  if(__atomic_load_n(&metrics_stopped, __ATOMIC_RELAXED))
+    return;
+
+  if(ez_replace_file(metrics_path, buffer, (size_t) n, 0) != 0)
+    return;
+
+  memcpy(previous, current, sizeof(previous));
+  written = 1;
+}
+
+static void *multicast_fun(void *arg)
 {
-  char *ptr = 0;
   char wr_buffer[2 * sizeof(long unsigned int) + 64];
-  int fd = -1;
   int n = 0;
-  ssize_t remaining = 0;
-  ssize_t rc = 0;
-  struct timeval tp;
+
+  (void) arg;
+
+  for(;;)
+    {
+      if((n = format_time(wr_buffer, sizeof(wr_buffer), 0, 0)) > 0)
+	if(sendto(multicast_fd, wr_buffer, (size_t) n, 0,
+		  (const struct sockaddr *) &multicast_addr,
+		  sizeof(multicast_addr)) == -1)
+	  if(disable_all_logs == 0)
+	    syslog(LOG_ERR, "sendto() failed, %s", strerror(errno));
+
+      sleep(multicast_interval);
+    }
+
+  return 0;
+}
+
+static void threads_stop(void)
+{
+  /*
+  ** Only the accepted connections outlive an upgrade. The multicast
+  ** and relay threads wait in cancellation points and take no lock
+  ** across one.
+  */
+
+  if(multicast_fd > -1)
+    {
+      pthread_cancel(multicast_thread);
+      pthread_join(multicast_thread, 0);
+      close(multicast_fd);
+      multicast_fd = -1;
+    }
+
+  if(relay_started)
+    {
+      pthread_cancel(relay_thread);
+      pthread_join(relay_thread, 0);
+      relay_started = 0;
+    }
+}
+
+static void *thread_fun(void *arg)
+{
+  int fd = -1;
 
   if(arg)
     fd = *((int *) arg);
@@ -287,24 +1900,45 @@ static void *thread_fun(void *arg)
   free(arg);
   pthread_detach(pthread_self());
 
-  if(fd < 0)
-    return 0;
+  if(fd >= 0)
+    serve(fd);
 
-  /*
-  ** Fetch the time.
-  */
+  __atomic_sub_fetch(&in_flight, 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+static void serve(int fd)
+{
+  char *ptr = 0;
+  char wr_buffer[2 * sizeof(long unsigned int) + 64];
+  int err = 0;
+  int linger = so_linger;
+  int n = 0;
+  socklen_t length = 0;
+  ssize_t remaining = -1;
+  ssize_t rc = 0;
+  struct ez_ntp_trace_record record;
+  struct sockaddr_in addr;
+  struct timeval served_tp;
+  struct timeval tp;
 
-  if(gettimeofday(&tp, (struct timezone *) 0) == 0)
+  memset(&addr, 0, sizeof(addr));
+
+  if(interleaved || trace)
     {
-      memset(wr_buffer, 0, sizeof(wr_buffer));
-      n = snprintf(wr_buffer, sizeof(wr_buffer),
-		   "%ld,%ld\r\n", (long) tp.tv_sec, (long) tp.tv_usec);
+      length = sizeof(addr);
 
-      if(!(n > 0 && n < (int) sizeof(wr_buffer)))
-	goto done_label;
+      if(getpeername(fd, (struct sockaddr *) &addr, &length) != 0 ||
+	 addr.sin_family != AF_INET)
+	memset(&addr, 0, sizeof(addr));
+    }
 
+  if((n = format_time(wr_buffer, sizeof(wr_buffer),
+		      interleaved && addr.sin_family == AF_INET ? &addr : 0,
+		      &served_tp)) > 0)
+    {
       ptr = wr_buffer;
-      remaining = (ssize_t) strlen(wr_buffer);
+      remaining = (ssize_t) n;
 
       while(remaining > 0)
 	{
@@ -312,6 +1946,8 @@ static void *thread_fun(void *arg)
 
 	  if(rc <= 0)
 	    {
+	      err = rc == -1 ? errno : EPIPE;
+
 	      if(rc == -1)
 		if(disable_all_logs == 0)
 		  syslog(LOG_ERR, "send() failed, %s", strerror(errno));
@@ -322,26 +1958,345 @@ static void *thread_fun(void *arg)
 	  remaining -= rc;
 	  ptr += rc;
 	}
+
+      if(interleaved && remaining == 0 && addr.sin_family == AF_INET)
+	interleaved_record(&addr, &served_tp);
+
+      if(trace)
+	{
+	  ez_ntp_gettime(&tp);
+	  memset(&record, 0, sizeof(record));
+	  record.action = remaining == 0 ?
+	    EZ_NTP_TRACE_SERVED : EZ_NTP_TRACE_FAILED;
+	  record.address = addr.sin_addr.s_addr;
+	  record.port = addr.sin_port;
+	  record.server_usec = ez_ntp_timeval_to_usec(&served_tp);
+	  record.transmit_usec = ez_ntp_timeval_to_usec(&tp);
+	  record.value = err;
+	  ez_ntp_trace_write(trace, &record);
+	}
     }
-  else if(disable_all_logs == 0)
-    syslog(LOG_ERR, "gettimeofday() failed, %s", strerror(errno));
 
- done_label:
+  /*
+  ** Unread data would turn close() into a reset.
+  */
+
+  if(fast_open)
+    while(recv(fd, wr_buffer, sizeof(wr_buffer), MSG_DONTWAIT) > 0)
+      ;
 
   shutdown(fd, SHUT_WR);
 
-  if(so_linger >= 0)
+  if(remaining != 0)
+    __atomic_add_fetch(&connections_dropped, 1, __ATOMIC_RELAXED);
+
+  if(linger > EZ_OVERLOAD_LINGER &&
+     __atomic_load_n(&overloaded, __ATOMIC_RELAXED))
+    linger = EZ_OVERLOAD_LINGER;
+
+  close_connection(fd, linger);
+}
+
+static void trace_query(const struct ez_ntp_query *query,
+			const struct sockaddr_in *addr)
+{
+  struct ez_ntp_trace_record record;
+
+  memset(&record, 0, sizeof(record));
+  record.address = addr->sin_addr.s_addr;
+  record.port = addr->sin_port;
+  record.transmit_usec = ez_ntp_timeval_to_usec(&query->sample.transmit_tp);
+
+  if(query->state == EZ_NTP_STATE_FINISHED)
+    {
+      record.action = EZ_NTP_TRACE_UPSTREAM;
+      record.delay = query->sample.delay;
+      record.offset = query->sample.offset;
+      record.receive_usec = ez_ntp_timeval_to_usec
+	(&query->sample.receive_tp);
+      record.server_usec = ez_ntp_timeval_to_usec
+	(&query->sample.response.server_tp);
+      record.stratum = (int16_t) query->sample.response.stratum;
+      record.value = query->sample.response.error;
+    }
+  else
     {
-      struct linger sol;
+      record.action = EZ_NTP_TRACE_FAILED;
+      record.state = (uint16_t) query->state;
+      record.value = query->error != 0 ? query->error : ETIMEDOUT;
+    }
 
-      sol.l_onoff = 1;
-      sol.l_linger = so_linger;
-      setsockopt(fd, SOL_SOCKET, SO_LINGER, &sol, sizeof(sol));
+  ez_ntp_trace_write(trace, &record);
+}
+
+static void onsignal(int signum)
+{
+  int saved_errno = errno;
+
+  if(signum == SIGHUP)
+    reload_requested = 1;
+  else
+    upgrade_requested = 1;
+
+  /*
+  ** Any thread may have received the signal. Wake the accept loop. A
+  ** full pipe already guarantees a wake-up.
+  */
+
+  while(write(signal_pipe[1], "1", 1) == -1 && errno == EINTR)
+    ;
+
+  errno = saved_errno;
+}
+
+static void overload_enter(const char *function, int err)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  __atomic_store_n(&overload_sec, (long) ts.tv_sec, __ATOMIC_RELAXED);
+
+  if(__atomic_load_n(&overloaded, __ATOMIC_RELAXED))
+    return;
+
+  __atomic_store_n(&overloaded, 1, __ATOMIC_RELAXED);
+
+  if(disable_all_logs == 0)
+    syslog(LOG_WARNING, "%s failed, %s, shedding load", function,
+	   strerror(err));
+}
+
+static void overload_leave(void)
+{
+  struct timespec ts;
+
+  backoff = 0;
+
+  if(!__atomic_load_n(&overloaded, __ATOMIC_RELAXED))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  if((long) ts.tv_sec - __atomic_load_n(&overload_sec, __ATOMIC_RELAXED) <
+     EZ_OVERLOAD_QUIET)
+    return;
+
+  __atomic_store_n(&overloaded, 0, __ATOMIC_RELAXED);
+
+  if(disable_all_logs == 0)
+    syslog(LOG_INFO, "overload cleared, %lu connections refused and %lu "
+	   "dropped so far",
+	   __atomic_load_n(&connections_refused, __ATOMIC_RELAXED),
+	   __atomic_load_n(&connections_dropped, __ATOMIC_RELAXED));
+}
+
+static int upgrade(void)
+{
+  char **env = 0;
+  char byte = 0;
+  char control[CMSG_SPACE(sizeof(int))];
+  char saved_pidfile[PATH_MAX];
+  int fds[2];
+  int rc = 0;
+  pid_t pid = 0;
+  size_t count = 0;
+  size_t i = 0;
+  struct cmsghdr *cmsg = 0;
+  struct iovec iov;
+  struct msghdr msg;
+  struct pollfd pfd;
+  static char upgrade_env[] = EZ_UPGRADE_ENV "=3";
+
+  if(strlen(program_path) == 0 || !saved_argv)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "%s", "the program path is unknown, upgrade canceled");
+
+      return -1;
     }
 
-  if(close(fd) != 0)
-    if(disable_all_logs == 0)
-      syslog(LOG_ERR, "close() failed, %s", strerror(errno));
+  /*
+  ** Prepare the new environment before fork(). The child may only issue
+  ** async-signal-safe calls.
+  */
+
+  while(environ && environ[count])
+    count += 1;
+
+  if((env = calloc(count + 2, sizeof(char *))) == 0)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "%s", "calloc() failed, upgrade canceled");
 
+      return -1;
+    }
+
+  for(count = 0, i = 0; environ && environ[i]; i++)
+    if(strncmp(environ[i], upgrade_env, strlen(EZ_UPGRADE_ENV) + 1) != 0)
+      env[count++] = environ[i];
+
+  env[count] = upgrade_env;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "socketpair() failed, %s, upgrade canceled",
+	       strerror(errno));
+
+      free(env);
+      return -1;
+    }
+
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+  /*
+  ** The new process creates its own process identifier file.
+  */
+
+  memcpy(saved_pidfile, pidfile, sizeof(saved_pidfile));
+
+  if(strlen(pidfile) > 0)
+    remove(pidfile);
+
+  memset(pidfile, 0, sizeof(pidfile));
+
+  if((pid = fork()) == 0)
+    {
+      if(fds[1] == EZ_LISTEN_FDS_START)
+	fcntl(fds[1], F_SETFD, 0);
+      else if(dup2(fds[1], EZ_LISTEN_FDS_START) == -1)
+	_exit(EXIT_FAILURE);
+
+#if defined(__linux__) && defined(SYS_close_range)
+      syscall(SYS_close_range, EZ_LISTEN_FDS_START + 1U, ~0U, 0U);
+#else
+      for(rc = EZ_LISTEN_FDS_START + 1; rc < 1024; rc++)
+	close(rc);
+#endif
+      execve(program_path, saved_argv, env);
+      _exit(EXIT_FAILURE);
+    }
+
+  close(fds[1]);
+  free(env);
+
+  if(pid == -1)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "fork() failed, %s, upgrade canceled", strerror(errno));
+
+      goto failure_label;
+    }
+
+  /*
+  ** Pass the listening socket and await the acknowledgment.
+  */
+
+  memset(control, 0, sizeof(control));
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = sizeof(byte);
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cmsg), &sock_fd, sizeof(int));
+
+  if(sendmsg(fds[0], &msg, 0) != 1)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "sendmsg() failed, %s, upgrade canceled",
+	       strerror(errno));
+
+      goto failure_label;
+    }
+
+  pfd.events = POLLIN;
+  pfd.fd = fds[0];
+  pfd.revents = 0;
+
+  while((rc = poll(&pfd, 1, EZ_UPGRADE_TIMEOUT)) == -1 && errno == EINTR)
+    ;
+
+  if(rc != 1 || read(fds[0], &byte, sizeof(byte)) != 1)
+    {
+      if(disable_all_logs == 0)
+	syslog(LOG_ERR, "%s", "the new process did not acknowledge, "
+	       "upgrade canceled");
+
+      goto failure_label;
+    }
+
+  close(fds[0]);
   return 0;
+
+ failure_label:
+  close(fds[0]);
+
+  if(pid > 0)
+    {
+      kill(pid, SIGTERM);
+      waitpid(pid, 0, 0);
+    }
+
+  memcpy(pidfile, saved_pidfile, sizeof(pidfile));
+
+  if(ez_write_pidfile() != 0)
+    memset(pidfile, 0, sizeof(pidfile));
+
+  return -1;
+}
+
+static int upgrade_receive(void)
+{
+  char byte = 0;
+  char control[CMSG_SPACE(sizeof(int))];
+  int channel_fd = -1;
+  int fd = -1;
+  struct cmsghdr *cmsg = 0;
+  struct iovec iov;
+  struct msghdr msg;
+
+  /*
+  ** The previous process's channel resides at EZ_LISTEN_FDS_START. Move
+  ** it aside and install the listening socket in its place.
+  */
+
+  memset(control, 0, sizeof(control));
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &byte;
+  iov.iov_len = sizeof(byte);
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if(recvmsg(EZ_LISTEN_FDS_START, &msg, 0) != 1)
+    return -1;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+
+  if(!cmsg || cmsg->cmsg_len != CMSG_LEN(sizeof(int)) ||
+     cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  if((channel_fd = fcntl(EZ_LISTEN_FDS_START, F_DUPFD_CLOEXEC,
+			 EZ_LISTEN_FDS_START + 1)) == -1 ||
+     dup2(fd, EZ_LISTEN_FDS_START) == -1)
+    {
+      if(channel_fd > -1)
+	close(channel_fd);
+
+      close(fd);
+      return -1;
+    }
+
+  close(fd);
+  return channel_fd;
 }